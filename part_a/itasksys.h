@@ -1,8 +1,88 @@
 #ifndef _ITASKSYS_H
 #define _ITASKSYS_H
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-typedef int TaskID;
+/*
+  Names a bulk task launch. Task systems may recycle the storage behind
+  an id once its launch is done, an id of a done launch must still read
+  as done afterwards.
+*/
+typedef int64_t TaskID;
+
+/*
+  How a launch waits for the launches it depends on.
+
+   - Full: no task starts before every task of every dependency is
+     done.
+   - ElementWise: task i starts once task i of each dependency is done.
+     Only dependencies with the same num_total_tasks can be met this
+     way, the others are waited for in full.
+*/
+enum class DependencyKind {
+    Full,
+    ElementWise,
+};
+
+/*
+  Which launches a task system serves first when several have work
+  ready. High is for small launches somebody waits on, Low for long
+  batch work. Task systems keep lower classes from starving, and may
+  ignore priorities altogether.
+*/
+enum class LaunchPriority {
+    High,
+    Normal,
+    Low,
+};
+
+constexpr int kNumLaunchPriorities = 3;
+
+/*
+  How a launch ended. A Cancelled one may have run some of its tasks,
+  or none.
+*/
+enum class LaunchStatus {
+    Done,
+    Cancelled,
+};
+
+/*
+  Per-launch knobs accepted by run() and runAsyncWithDeps(). A value
+  left at its default lets the task system decide.
+*/
+struct LaunchOptions {
+    /*
+      Number of task ids a worker claims at once. 0 uses the task
+      system's grain policy.
+    */
+    int grain_size = 0;
+
+    /*
+      Dependency kind for `deps` of runAsyncWithDeps(). Task systems
+      may treat any dependency as Full, which is always correct.
+    */
+    DependencyKind dependency = DependencyKind::Full;
+
+    LaunchPriority priority = LaunchPriority::Normal;
+
+    /*
+      Exempts the launch from the task system's limits on pending work,
+      for launches that only carry on work already admitted and must not
+      be held back behind it.
+    */
+    bool unlimited = false;
+};
 
 class IRunnable {
     public:
@@ -20,6 +100,299 @@ class IRunnable {
         virtual void runTask(int task_id, int num_total_tasks) = 0;
 };
 
+/*
+  A runnable whose tasks can be run a contiguous range of ids at a time.
+  It is passed to run() and runAsyncWithDeps() like any IRunnable, task
+  systems that know about it call runRange() once per chunk of ids they
+  claim rather than runTask() once per id. Others keep calling
+  runTask(), which runs a range of one.
+*/
+class IRangeRunnable: public IRunnable {
+    public:
+        /*
+          Executes tasks begin to end-1 of the bulk task launch, the same
+          as calling runTask() for each of them in turn.
+        */
+        virtual void runRange(int begin, int end, int num_total_tasks) = 0;
+
+        /*
+          Called instead of runRange(begin, end, num_total_tasks) for
+          tasks the task system skips because their launch was
+          cancelled or one of its tasks threw. Task systems that run
+          launches through runRange() hand each task id to one of the
+          two exactly once, and both return before the launch is done.
+          If runRange() throws, the rest of its range is neither run
+          nor skipped.
+        */
+        virtual void skipRange(int, int, int) {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            runRange(task_id, task_id + 1, num_total_tasks);
+        }
+};
+
+/*
+  Bump-pointer scratch memory of one worker, see WorkerContext. It grows
+  in blocks and keeps them, so once warmed up allocate() costs a few
+  instructions and no malloc. No destructors are run on what it hands
+  out.
+*/
+class ScratchArena {
+    public:
+        // a position in the arena, for rewind()
+        struct Mark {
+            size_t block = 0;
+            size_t used  = 0;
+        };
+
+        ScratchArena() = default;
+        ScratchArena(const ScratchArena&)            = delete;
+        ScratchArena& operator=(const ScratchArena&) = delete;
+
+        ~ScratchArena() {
+            for (Block& block : blocks_) {
+                ::operator delete(block.data, std::align_val_t{kBlockAlign});
+            }
+        }
+
+        // `align` must be a power of two
+        void* allocate(size_t bytes,
+                       size_t align = alignof(std::max_align_t)) {
+            if (block_ < blocks_.size()) {
+                if (void* p = bump(bytes, align)) {
+                    return p;
+                }
+            }
+            return allocateSlow(bytes, align);
+        }
+
+        // room for `count` objects of type T, not constructed
+        template <typename T>
+        T* allocate(size_t count) {
+            return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+        }
+
+        Mark mark() const { return Mark{block_, used_}; }
+
+        // gives back everything allocated since `mark` was taken
+        void rewind(Mark mark) {
+            block_ = mark.block;
+            used_  = mark.used;
+        }
+
+        void reset() { rewind(Mark{}); }
+
+        // bytes held, handed out or not
+        size_t capacity() const {
+            size_t total = 0;
+            for (const Block& block : blocks_) {
+                total += block.size;
+            }
+            return total;
+        }
+
+    private:
+        static constexpr size_t kBlockAlign   = 64;
+        static constexpr size_t kMinBlockSize = 16 * 1024;
+
+        struct Block {
+            std::byte* data;
+            size_t size;
+        };
+
+        // takes `bytes` from the current block, nullptr if they don't fit
+        void* bump(size_t bytes, size_t align) {
+            Block& block   = blocks_[block_];
+            uintptr_t base = reinterpret_cast<uintptr_t>(block.data);
+            size_t at      = ((base + used_ + align - 1) & ~(align - 1)) - base;
+            if (at > block.size || bytes > block.size - at) {
+                return nullptr;
+            }
+            used_ = at + bytes;
+            return block.data + at;
+        }
+
+        void* allocateSlow(size_t bytes, size_t align) {
+            // blocks past the current one were left by rewind(), the
+            // first one they fit in is used before growing
+            size_t first = blocks_.empty() ? 0 : block_ + 1;
+            for (block_ = first; block_ < blocks_.size(); block_++) {
+                used_ = 0;
+                if (void* p = bump(bytes, align)) {
+                    return p;
+                }
+            }
+            size_t size = std::max({kMinBlockSize, bytes + align,
+                                    blocks_.empty() ? 0
+                                                    : 2 * blocks_.back().size});
+            blocks_.push_back(Block{
+                static_cast<std::byte*>(
+                    ::operator new(size, std::align_val_t{kBlockAlign})),
+                size});
+            block_ = blocks_.size() - 1;
+            used_  = 0;
+            return bump(bytes, align);
+        }
+
+        std::vector<Block> blocks_;
+        size_t block_ = 0;  // the block allocate() takes from
+        size_t used_  = 0;  // bytes taken from it
+};
+
+/*
+  What a task of an IContextRunnable learns about the thread running it.
+
+   - worker_index: in [0, ITaskSystem::numWorkerContexts()), the same
+     for a thread as long as the task system lives. Two tasks with the
+     same index never run at the same time, so per-worker accumulators
+     indexed by it need no atomics. A task that waits for other launches
+     from inside the task system may run further tasks meanwhile, on
+     its own thread and with its own index.
+   - scratch: rewound once each task returns, so a task gets back what
+     it allocated and nothing of the tasks before it.
+
+  Task systems own one per thread they run tasks on and point `current`
+  at it while they do.
+*/
+struct WorkerContext {
+    int worker_index = 0;
+    ScratchArena scratch;
+
+    static inline thread_local WorkerContext* current = nullptr;
+};
+
+/*
+  A runnable whose tasks get the WorkerContext of the thread running
+  them, e.g. to add into per-worker accumulators or to take temporary
+  buffers from the worker's scratch arena instead of malloc. It is
+  passed to run() and runAsyncWithDeps() like any IRunnable. On task
+  systems that run tasks without a context (numWorkerContexts() is 0),
+  each thread uses a context of its own, all with worker index 0.
+*/
+class IContextRunnable: public IRangeRunnable {
+    public:
+        using IRangeRunnable::runTask;
+
+        virtual void runTask(int task_id, int num_total_tasks,
+                             WorkerContext& context) = 0;
+
+        void runRange(int begin, int end, int num_total_tasks) {
+            static thread_local WorkerContext fallback;
+            WorkerContext& context = WorkerContext::current != nullptr
+                                         ? *WorkerContext::current
+                                         : fallback;
+            for (int i = begin; i < end; i++) {
+                ScratchArena::Mark mark = context.scratch.mark();
+                try {
+                    runTask(i, num_total_tasks, context);
+                } catch (...) {
+                    context.scratch.rewind(mark);
+                    throw;
+                }
+                context.scratch.rewind(mark);
+            }
+        }
+};
+
+/*
+  An immutable recording of bulk task launches and the dependencies
+  between them, made with TaskGraphBuilder and launched as a whole with
+  ITaskSystem::runGraph(). Node i is the i-th launch added to the
+  builder. Dependency lists, successor lists and in-degrees are worked
+  out once when the graph is built.
+*/
+class TaskGraph {
+    public:
+        struct Node {
+            IRunnable* runnable;
+            int num_total_tasks;
+            LaunchOptions options;
+        };
+
+        int size() const { return nodes_.size(); }
+        const Node& node(int i) const { return nodes_[i]; }
+
+        // nodes that node i waits for, all added before it
+        std::span<const int> deps(int i) const {
+            return {deps_.data() + dep_begin_[i],
+                    deps_.data() + dep_begin_[i + 1]};
+        }
+
+        // nodes that wait for node i
+        std::span<const int> successors(int i) const {
+            return {successors_.data() + successor_begin_[i],
+                    successors_.data() + successor_begin_[i + 1]};
+        }
+
+        int inDegree(int i) const { return dep_begin_[i + 1] - dep_begin_[i]; }
+
+        // differs between graphs built separately, copies share it
+        uint64_t id() const { return id_; }
+
+        // expires once the last copy of a built graph is gone, task
+        // systems keeping state per graph drop it then
+        std::weak_ptr<const void> lifetime() const { return lifetime_; }
+
+    private:
+        friend class TaskGraphBuilder;
+
+        uint64_t id_ = 0;
+        std::shared_ptr<const void> lifetime_;
+        std::vector<Node> nodes_;
+        std::vector<int> dep_begin_{0};
+        std::vector<int> deps_;
+        std::vector<int> successor_begin_{0};
+        std::vector<int> successors_;
+};
+
+class TaskGraphBuilder {
+    public:
+        /*
+          Records a launch, taking the same arguments as
+          runAsyncWithDeps(). `deps` must be ids returned by earlier
+          add() calls on this builder.
+        */
+        TaskID add(IRunnable* runnable, int num_total_tasks,
+                   const std::vector<TaskID>& deps,
+                   const LaunchOptions& options = LaunchOptions{}) {
+            graph.nodes_.push_back({runnable, num_total_tasks, options});
+            graph.deps_.insert(graph.deps_.end(), deps.begin(), deps.end());
+            graph.dep_begin_.push_back(graph.deps_.size());
+            return graph.nodes_.size() - 1;
+        }
+
+        TaskGraph build() const {
+            static std::atomic<uint64_t> next_id{1};
+
+            TaskGraph built = graph;
+            built.id_       = next_id.fetch_add(1);
+            built.lifetime_ = std::make_shared<const uint64_t>(built.id_);
+
+            int n = built.nodes_.size();
+            std::vector<int> counts(n + 1, 0);
+            for (int dep : built.deps_) {
+                counts[dep + 1]++;
+            }
+            built.successor_begin_.assign(n + 1, 0);
+            for (int i = 0; i < n; i++) {
+                built.successor_begin_[i + 1] =
+                    built.successor_begin_[i] + counts[i + 1];
+            }
+            built.successors_.resize(built.deps_.size());
+            std::vector<int> fill(built.successor_begin_.begin(),
+                                  built.successor_begin_.end() - 1);
+            for (int i = 0; i < n; i++) {
+                for (int dep : built.deps(i)) {
+                    built.successors_[fill[dep]++] = i;
+                }
+            }
+            return built;
+        }
+
+    private:
+        TaskGraph graph;
+};
+
 class ITaskSystem {
     public:
         /*
@@ -37,9 +410,22 @@ class ITaskSystem {
           execution is synchronous with the calling thread, so run()
           will return only when the execution of all tasks is
           complete.
+
+          If a task throws, task ids no thread claimed yet are
+          skipped and run() rethrows the first exception once the
+          tasks already running returned.
         */
         virtual void run(IRunnable* runnable, int num_total_tasks) = 0;
 
+        /*
+          Same as run(), with per-launch options. Task systems that
+          have no use for the options just ignore them.
+        */
+        virtual void run(IRunnable* runnable, int num_total_tasks,
+                         const LaunchOptions&) {
+            run(runnable, num_total_tasks);
+        }
+
         /*
           Executes an asynchronous bulk task launch of
           num_total_tasks, but with a dependency on prior launched
@@ -61,10 +447,321 @@ class ITaskSystem {
         virtual TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                         const std::vector<TaskID>& deps) = 0;
 
+        /*
+          Same as runAsyncWithDeps(), with per-launch options.
+        */
+        virtual TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                        const std::vector<TaskID>& deps,
+                                        const LaunchOptions&) {
+            return runAsyncWithDeps(runnable, num_total_tasks, deps);
+        }
+
+        /*
+          Same as runAsyncWithDeps(), with the dependencies in any
+          contiguous range, so a caller with one or two of them need
+          not build a vector. The default copies them into one.
+        */
+        virtual TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                        std::span<const TaskID> deps,
+                                        const LaunchOptions& options) {
+            return runAsyncWithDeps(
+                runnable, num_total_tasks,
+                std::vector<TaskID>(deps.begin(), deps.end()), options);
+        }
+
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                std::span<const TaskID> deps) {
+            return runAsyncWithDeps(runnable, num_total_tasks, deps,
+                                    LaunchOptions{});
+        }
+
+        /*
+          Same as runAsyncWithDeps(), for task systems that limit how
+          much work may be pending: where runAsyncWithDeps() would wait
+          for room, this returns nothing and launches nothing. The
+          default has no limit and always launches.
+        */
+        virtual std::optional<TaskID> tryRunAsyncWithDeps(
+            IRunnable* runnable, int num_total_tasks,
+            std::span<const TaskID> deps, const LaunchOptions& options) {
+            return runAsyncWithDeps(runnable, num_total_tasks, deps, options);
+        }
+
+        std::optional<TaskID> tryRunAsyncWithDeps(
+            IRunnable* runnable, int num_total_tasks,
+            std::span<const TaskID> deps) {
+            return tryRunAsyncWithDeps(runnable, num_total_tasks, deps,
+                                       LaunchOptions{});
+        }
+
+        /*
+          Executes every launch of `graph`, respecting its
+          dependencies. Like run(), it returns once all of them are
+          done. The default resubmits the launches one by one through
+          runAsyncWithDeps().
+        */
+        virtual void runGraph(const TaskGraph& graph) {
+            std::vector<TaskID> ids(graph.size());
+            std::vector<TaskID> deps;
+            for (int i = 0; i < graph.size(); i++) {
+                deps.clear();
+                for (int dep : graph.deps(i)) {
+                    deps.push_back(ids[dep]);
+                }
+                const TaskGraph::Node& node = graph.node(i);
+                ids[i] = runAsyncWithDeps(node.runnable, node.num_total_tasks,
+                                          deps, node.options);
+            }
+            sync();
+        }
+
         /*
           Blocks until all tasks created as a result of **any prior**
           runXXX calls are done.
+
+          A launch one of whose tasks throws is cancelled like by
+          cancel(), with its dependents. sync() then rethrows the
+          first such exception since the last sync() that no wait()
+          or run() rethrew already.
          */
         virtual void sync() = 0;
+
+        /*
+          Same as sync(), and fills `cancelled` with the ids of the
+          launches that ended cancelled since the last sync(), in the
+          order they ended, including ones whose tasks threw. The
+          ids are filled in before any exception is rethrown. The
+          default never cancels.
+        */
+        virtual void sync(std::vector<TaskID>& cancelled) {
+            cancelled.clear();
+            sync();
+        }
+
+        /*
+          Blocks until the launch `task_id` returned by
+          runAsyncWithDeps() is done, which implies its dependencies
+          are done too, and tells whether it was cancelled. If one of
+          its tasks threw, the first exception is rethrown instead.
+          Once a sync() returned after the launch, it may read as Done
+          either way. The default waits for everything, like sync().
+        */
+        virtual LaunchStatus wait(TaskID) {
+            sync();
+            return LaunchStatus::Done;
+        }
+
+        /*
+          Cancels launch `task_id` and every launch that depends on it,
+          directly or not, including ones submitted later up to the
+          next sync(). Task ids no worker claimed yet never run, claimed
+          ones run to the end. A cancelled launch is done once the
+          launches it depends on are done and its claimed task ids ran.
+          Returns false if the launch was done already. The default
+          cannot cancel anything.
+        */
+        virtual bool cancel(TaskID) {
+            return false;
+        }
+
+        /*
+          Returns a stream on this task system's threads: a task system
+          of its own for one submitting thread at a time, with its own
+          launch ids and a sync() that only waits for the launches made
+          through it. The stream must go before the task system does.
+          The default has no streams and returns nullptr.
+        */
+        virtual std::unique_ptr<ITaskSystem> createStream() {
+            return nullptr;
+        }
+
+        /*
+          Returns whether several threads may call runAsyncWithDeps(),
+          tryRunAsyncWithDeps(), cancel() and sync() at once, with ids
+          one thread got as dependencies on another. The default says
+          no, such task systems take one submitting thread at a time.
+        */
+        virtual bool supportsConcurrentSubmit() {
+            return false;
+        }
+
+        /*
+          Returns the number of WorkerContexts the task system runs
+          IContextRunnable tasks with, WorkerContext::worker_index is
+          below it. The default runs them without, see IContextRunnable.
+        */
+        virtual int numWorkerContexts() {
+            return 0;
+        }
+
+        /*
+          Returns whether the launch `task_id` is done, without
+          blocking. The default suits task systems that finish every
+          launch before runAsyncWithDeps() returns.
+        */
+        virtual bool isDone(TaskID) {
+            return true;
+        }
+
+        /*
+          Calls fn(i) for every i in [begin, end) and returns once all
+          calls are done, like run(). Each task of the launch covers
+          `grain` consecutive indices. fn is wrapped in one
+          IRangeRunnable for the whole launch, so the only virtual call
+          is one per chunk of tasks a worker claims and fn can be
+          inlined into the loop over it.
+        */
+        template <typename F>
+        void parallel_for(int begin, int end, int grain, F&& fn);
+
+        /*
+          Like runAsyncWithDeps(), with fn(task_id, num_total_tasks)
+          as the task body. fn is moved or copied into the launch and
+          destroyed once its last task is done or skipped, so it may
+          outlive the caller's frame but whatever it captures by
+          reference must not.
+        */
+        template <typename F>
+        TaskID launch(int num_total_tasks, F&& fn,
+                      const std::vector<TaskID>& deps,
+                      const LaunchOptions& options = LaunchOptions{});
+};
+
+/*
+  The launch behind ITaskSystem::parallel_for(). Task t calls fn over
+  the t-th chunk of `grain` indices, fn itself lives in the caller.
+*/
+template <typename F>
+class ParallelForRunnable: public IRangeRunnable {
+    public:
+        ParallelForRunnable(int begin, int end, int grain, F& fn)
+            : begin_(begin), end_(end), grain_(grain), fn_(fn) {}
+
+        void runRange(int begin, int end, int) {
+            int first = begin_ + begin * grain_;
+            int last  = first + std::min<int64_t>(
+                                    int64_t{end - begin} * grain_,
+                                    end_ - first);
+            for (int i = first; i < last; i++) {
+                fn_(i);
+            }
+        }
+
+    private:
+        int begin_;
+        int end_;
+        int grain_;
+        F& fn_;
+};
+
+/*
+  The launch behind ITaskSystem::launch(). It owns fn and deletes
+  itself after its last task ran or was skipped, task systems never
+  touch a runnable once all of its tasks have returned.
+*/
+template <typename F>
+class LaunchRunnable: public IRangeRunnable {
+    public:
+        template <typename G>
+        LaunchRunnable(G&& fn, int num_total_tasks)
+            : fn_(std::forward<G>(fn)), remaining_(num_total_tasks) {}
+
+        void runRange(int begin, int end, int num_total_tasks) {
+            try {
+                for (int i = begin; i < end; i++) {
+                    fn_(i, num_total_tasks);
+                }
+            } catch (...) {
+                // the tasks after the one that threw are never run, and
+                // the task system does not skip them either
+                finish(end - begin);
+                throw;
+            }
+            finish(end - begin);
+        }
+
+        void skipRange(int begin, int end, int) {
+            finish(end - begin);
+        }
+
+    private:
+        void finish(int count) {
+            if (remaining_.fetch_sub(count, std::memory_order_acq_rel) ==
+                count) {
+                delete this;
+            }
+        }
+
+        F fn_;
+        std::atomic<int> remaining_;
+};
+
+template <typename F>
+void ITaskSystem::parallel_for(int begin, int end, int grain, F&& fn) {
+    if (end <= begin) {
+        return;
+    }
+    grain = std::max(grain, 1);
+    int64_t num_chunks = (int64_t{end} - begin + grain - 1) / grain;
+    ParallelForRunnable<std::remove_reference_t<F>> runnable(begin, end,
+                                                             grain, fn);
+    run(&runnable, static_cast<int>(num_chunks));
+}
+
+template <typename F>
+TaskID ITaskSystem::launch(int num_total_tasks, F&& fn,
+                           const std::vector<TaskID>& deps,
+                           const LaunchOptions& options) {
+    auto* runnable = new LaunchRunnable<std::decay_t<F>>(std::forward<F>(fn),
+                                                         num_total_tasks);
+    TaskID task_id =
+        runAsyncWithDeps(runnable, num_total_tasks, deps, options);
+    // without tasks nothing would ever delete it
+    if (num_total_tasks <= 0) {
+        delete runnable;
+    }
+    return task_id;
+}
+
+/*
+  Lets a coroutine co_await a launch returned by runAsyncWithDeps():
+
+      co_await LaunchAwaiter(t, task_id);
+
+  If the launch is not done yet, the coroutine is suspended and a
+  one-task launch depending on it is submitted, whose task resumes the
+  coroutine. So the coroutine carries on on one of the task system's
+  threads, inside that task, and no thread blocks while it waits. Any
+  launch it makes from there is nested in that task.
+*/
+class LaunchAwaiter: public IRunnable {
+    public:
+        LaunchAwaiter(ITaskSystem* system, TaskID task_id)
+            : system_(system), task_id_(task_id) {}
+
+        bool await_ready() { return system_->isDone(task_id_); }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            handle_ = handle;
+            // the coroutine may be resumed before this returns, the
+            // awaiter lives in its frame and must not be touched after.
+            // The resume only carries on work admitted before, it must
+            // not wait for room on the thread that suspended
+            LaunchOptions options;
+            options.unlimited = true;
+            system_->runAsyncWithDeps(
+                this, 1, std::span<const TaskID>(&task_id_, 1), options);
+        }
+
+        void await_resume() {}
+
+        void runTask(int, int) {
+            handle_.resume();
+        }
+
+    private:
+        ITaskSystem* system_;
+        TaskID task_id_;
+        std::coroutine_handle<> handle_;
 };
 #endif
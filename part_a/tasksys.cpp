@@ -1,10 +1,12 @@
 #include "tasksys.h"
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <cstdio>
+#include <exception>
 #include <mutex>
-#include <print>
 #include <thread>
+#include <utility>
 #include <vector>
 #include "itasksys.h"
 
@@ -77,6 +79,9 @@ void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
     //
 
     std::atomic_int num_finished{0};
+    // the first exception a task threw, rethrown once every thread is done
+    std::exception_ptr error;
+    std::mutex error_mu;
 
     std::vector<std::thread> threads{};
     for (int i = 0; i < num_threads; i++) {
@@ -84,10 +89,19 @@ void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
         threads.push_back(std::thread([&]() {
             while (true) {
                 int num = num_finished.fetch_add(1);
-                if (num > num_total_tasks) {
+                if (num >= num_total_tasks) {
                     break;
                 }
-                runnable->runTask(num, num_total_tasks);
+                try {
+                    runnable->runTask(num, num_total_tasks);
+                } catch (...) {
+                    std::scoped_lock<std::mutex> lck{error_mu};
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    // nobody claims the tasks left
+                    num_finished.store(num_total_tasks);
+                }
             }
         }));
     }
@@ -95,6 +109,9 @@ void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
     for (auto& thread : threads) {
         thread.join();
     }
+    if (error) {
+        std::rethrow_exception(error);
+    }
 }
 
 TaskID TaskSystemParallelSpawn::runAsyncWithDeps(
@@ -108,6 +125,15 @@ void TaskSystemParallelSpawn::sync() {
     return;
 }
 
+/*
+ * Number of task ids a pool worker claims at once: a share of the ids left,
+ * so chunks shrink as a launch runs out of work and the last ones still
+ * spread over all workers.
+ */
+static int chunkSize(int remaining, int num_workers) {
+    return std::max(remaining / (2 * num_workers), 1);
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Spinning Task System Implementation
@@ -155,17 +181,43 @@ TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(
                     continue;
                 }
 
-                int current = 0;
-                while ((current = num_started.fetch_add(1)) <
-                       _num_total_tasks) {
-                    _runnable->runTask(current, _num_total_tasks);
-                    num_finished.fetch_add(1);
+                while (true) {
+                    int grain   = chunkSize(_num_total_tasks -
+                                                num_started.load(),
+                                            this->num_threads);
+                    int current = num_started.fetch_add(grain);
+                    if (current >= _num_total_tasks) {
+                        break;
+                    }
+                    runClaimed(current,
+                               std::min(current + grain, _num_total_tasks));
                 }
             }
         });
     }
 }
 
+void TaskSystemParallelThreadPoolSpinning::runClaimed(int begin, int end) {
+    // ids of the chunk after one that threw count as run
+    int count = end - begin;
+    try {
+        for (int i = begin; i < end; i++) {
+            _runnable->runTask(i, _num_total_tasks);
+        }
+    } catch (...) {
+        {
+            std::scoped_lock<std::mutex> lck{mu};
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+        // task ids nobody claimed yet are skipped, but counted here
+        int unclaimed = num_started.exchange(_num_total_tasks);
+        count += std::max(_num_total_tasks - unclaimed, 0);
+    }
+    num_finished.fetch_add(count);
+}
+
 TaskSystemParallelThreadPoolSpinning::~TaskSystemParallelThreadPoolSpinning() {
     {
         std::scoped_lock<std::mutex> lck{mu};
@@ -196,10 +248,15 @@ void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable,
     while (num_finished < num_total_tasks) {}
 
     // it is very tricky to determine whether all jobs have been finished
+    std::exception_ptr failed;
     {
         std::scoped_lock<std::mutex> lck{mu};
         _runnable = nullptr;
         _num_total_tasks = -1;
+        failed = std::exchange(error, nullptr);
+    }
+    if (failed) {
+        std::rethrow_exception(failed);
     }
 }
 
@@ -262,11 +319,16 @@ TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(
                     // has not set has_work to false
                     continue;
                 }
-                int current = 0;
-                while ((current = num_started.fetch_add(1)) <
-                       _num_total_tasks) {
-                    _runnable->runTask(current, _num_total_tasks);
-                    num_finished.fetch_add(1);
+                while (true) {
+                    int grain   = chunkSize(_num_total_tasks -
+                                                num_started.load(),
+                                            this->num_threads);
+                    int current = num_started.fetch_add(grain);
+                    if (current >= _num_total_tasks) {
+                        break;
+                    }
+                    runClaimed(current,
+                               std::min(current + grain, _num_total_tasks));
                 }
 
             }
@@ -274,6 +336,27 @@ TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(
     }
 }
 
+void TaskSystemParallelThreadPoolSleeping::runClaimed(int begin, int end) {
+    // ids of the chunk after one that threw count as run
+    int count = end - begin;
+    try {
+        for (int i = begin; i < end; i++) {
+            _runnable->runTask(i, _num_total_tasks);
+        }
+    } catch (...) {
+        {
+            std::scoped_lock<std::mutex> lck{mu};
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+        // task ids nobody claimed yet are skipped, but counted here
+        int unclaimed = num_started.exchange(_num_total_tasks);
+        count += std::max(_num_total_tasks - unclaimed, 0);
+    }
+    num_finished.fetch_add(count);
+}
+
 TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
     //
     // TODO: CS149 student implementations may decide to perform cleanup
@@ -315,9 +398,14 @@ void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable,
         // std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 
+    std::exception_ptr failed;
     {
         std::scoped_lock<std::mutex> lck {mu};
         has_work = false;
+        failed = std::exchange(error, nullptr);
+    }
+    if (failed) {
+        std::rethrow_exception(failed);
     }
 }
 
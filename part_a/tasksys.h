@@ -4,6 +4,7 @@
 #include "itasksys.h"
 #include <atomic>
 #include <condition_variable>
+#include <exception>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -68,10 +69,14 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
 
         IRunnable* _runnable;
         int _num_total_tasks;
+        // first exception a task of the launch threw, guarded by mu
+        std::exception_ptr error;
 
         std::mutex mu;
 
         bool shutdown;
+
+        void runClaimed(int begin, int end);
 };
 
 /*
@@ -102,10 +107,14 @@ class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
 
         IRunnable* _runnable;
         int _num_total_tasks;
+        // first exception a task of the launch threw, guarded by mu
+        std::exception_ptr error;
         
         bool has_work;
         bool shutdown;
         bool work_finished;
+
+        void runClaimed(int begin, int end);
 };
 
 #endif
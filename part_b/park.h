@@ -0,0 +1,213 @@
+#ifndef _PARK_H
+#define _PARK_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <thread>
+#include <utility>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * WaitStrategy: how a thread waits for a condition to become true.
+ *
+ * It first polls with a CPU pause between checks for `spin_us`, then polls
+ * with std::this_thread::yield() between checks for `yield_us`, then parks
+ * on an EventCount until someone notifies it. A negative `yield_us` never
+ * parks, the thread keeps yielding instead.
+ */
+struct WaitStrategy {
+    int spin_us  = 20;
+    int yield_us = 50;
+};
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+inline void futexWait(std::atomic<uint32_t>* word, uint32_t expected) {
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE,
+            expected, nullptr, nullptr, 0);
+#else
+    word->wait(expected);
+#endif
+}
+
+// like futexWait(), but returns once `timeout` passed as well
+inline void futexWaitFor(std::atomic<uint32_t>* word, uint32_t expected,
+                         std::chrono::nanoseconds timeout) {
+#if defined(__linux__)
+    struct timespec ts;
+    ts.tv_sec  = timeout.count() / 1000000000;
+    ts.tv_nsec = timeout.count() % 1000000000;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE,
+            expected, &ts, nullptr, 0);
+#else
+    // no timed wait on std::atomic, poll instead
+    if (word->load() == expected) {
+        std::this_thread::sleep_for(
+            std::min<std::chrono::nanoseconds>(timeout,
+                                               std::chrono::milliseconds(1)));
+    }
+#endif
+}
+
+inline void futexWake(std::atomic<uint32_t>* word, int count) {
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE,
+            count, nullptr, nullptr, 0);
+#else
+    if (count == 1) {
+        word->notify_one();
+    } else {
+        word->notify_all();
+    }
+#endif
+}
+
+/*
+ * EventCount: lets threads park until some condition they check themselves
+ * may have changed, without a mutex.
+ *
+ * A waiter calls prepareWait(), re-checks its condition, then either
+ * cancelWait() or commitWait() with the key it got. A notifier publishes its
+ * change first and then calls notify, which tells whether anyone was
+ * waiting. Notifying with nobody parked is a fence and a load.
+ */
+class EventCount {
+    public:
+        EventCount() : epoch(0), waiters(0) {}
+
+        uint32_t prepareWait() {
+            waiters.fetch_add(1, std::memory_order_seq_cst);
+            return epoch.load(std::memory_order_seq_cst);
+        }
+
+        void cancelWait() { waiters.fetch_sub(1, std::memory_order_relaxed); }
+
+        void commitWait(uint32_t key) {
+            while (epoch.load(std::memory_order_acquire) == key) {
+                futexWait(&epoch, key);
+            }
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        // like commitWait(), false if `deadline` came first
+        bool commitWaitUntil(uint32_t key,
+                             std::chrono::steady_clock::time_point deadline) {
+            while (epoch.load(std::memory_order_acquire) == key) {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= deadline) {
+                    waiters.fetch_sub(1, std::memory_order_relaxed);
+                    return false;
+                }
+                futexWaitFor(&epoch, key, deadline - now);
+            }
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        bool notifyOne() { return notify(1); }
+        bool notifyAll() { return notify(INT_MAX); }
+
+    private:
+        bool notify(int count) {
+            // pairs with the waiters bump in prepareWait()
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters.load(std::memory_order_relaxed) == 0) {
+                return false;
+            }
+            epoch.fetch_add(1, std::memory_order_release);
+            futexWake(&epoch, count);
+            return true;
+        }
+
+        alignas(64) std::atomic<uint32_t> epoch;
+        std::atomic<uint32_t> waiters;
+};
+
+/*
+ * Waits according to `strategy` until `ready()` returns true, or until
+ * `timeout` passed. Returns whether `ready()` did. `ready` may have side
+ * effects, like taking the work item it was looking for, it is not called
+ * again once it returned true.
+ */
+template <typename Pred>
+bool waitFor(const WaitStrategy& strategy, EventCount& event, Pred&& ready,
+             std::chrono::nanoseconds timeout) {
+    if (ready()) {
+        return true;
+    }
+
+    using clock   = std::chrono::steady_clock;
+    auto start    = clock::now();
+    bool timed    = timeout != std::chrono::nanoseconds::max();
+    auto deadline = timed ? start + timeout : clock::time_point::max();
+    auto spin =
+        std::min(start + std::chrono::microseconds(strategy.spin_us), deadline);
+    // a negative yield_us yields until the deadline, if there is one
+    auto yield =
+        strategy.yield_us < 0
+            ? deadline
+            : std::min(spin + std::chrono::microseconds(strategy.yield_us),
+                       deadline);
+
+    // reading the clock costs more than a pause, only do it now and then
+    for (int i = 1;; i++) {
+        cpuRelax();
+        if (ready()) {
+            return true;
+        }
+        if (i % 64 == 0 && clock::now() >= spin) {
+            break;
+        }
+    }
+    while (clock::now() < yield) {
+        std::this_thread::yield();
+        if (ready()) {
+            return true;
+        }
+    }
+
+    while (true) {
+        uint32_t key = event.prepareWait();
+        if (ready()) {
+            event.cancelWait();
+            return true;
+        }
+        if (!timed) {
+            event.commitWait(key);
+        } else if (!event.commitWaitUntil(key, deadline)) {
+            return ready();
+        }
+        if (ready()) {
+            return true;
+        }
+    }
+}
+
+// waitFor() without a timeout
+template <typename Pred>
+void waitUntil(const WaitStrategy& strategy, EventCount& event, Pred&& ready) {
+    waitFor(strategy, event, std::forward<Pred>(ready),
+            std::chrono::nanoseconds::max());
+}
+
+#endif
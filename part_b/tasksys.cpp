@@ -2,10 +2,16 @@
 #include "tasksys.h"
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <mutex>
 #include <thread>
+#include <typeinfo>
+#include <utility>
 #include <vector>
 #include "itasksys.h"
 
@@ -14,6 +20,61 @@ IRunnable::~IRunnable() {}
 ITaskSystem::ITaskSystem(int num_threads) {}
 ITaskSystem::~ITaskSystem() {}
 
+/*
+ * The task system whose tasks the current thread is running, if any, and
+ * the thread's deque index in it. A run() from inside runTask() finds its
+ * own task system here and must not wait like an outside caller would,
+ * the launch it was called from is still in flight.
+ */
+static thread_local ITaskSystem* current_pool = nullptr;
+static thread_local int current_index         = -1;
+
+// sets current_pool for the lifetime of the scope
+class PoolScope {
+    public:
+        PoolScope(ITaskSystem* pool, int index = -1)
+            : saved_pool(current_pool), saved_index(current_index) {
+            current_pool  = pool;
+            current_index = index;
+        }
+        ~PoolScope() {
+            current_pool  = saved_pool;
+            current_index = saved_index;
+        }
+
+    private:
+        ITaskSystem* saved_pool;
+        int saved_index;
+};
+
+// points WorkerContext::current at `context` for the lifetime of the scope
+class ContextScope {
+    public:
+        ContextScope(WorkerContext* context) : saved(WorkerContext::current) {
+            WorkerContext::current = context;
+        }
+        ~ContextScope() { WorkerContext::current = saved; }
+
+    private:
+        WorkerContext* saved;
+};
+
+// launches made by runAsyncWithDeps() from tasks running on this thread, a
+// sync() from a task waits for the ones from nested_scope on
+static thread_local std::vector<TaskID> nested_launches;
+static thread_local size_t nested_scope = 0;
+
+// joinLaunches() calls on this thread's stack, each helped chunk may join
+// launches of its own one level further down
+static thread_local int join_depth = 0;
+static constexpr int kMaxJoinDepth = 64;
+
+class JoinDepthScope {
+    public:
+        JoinDepthScope() { join_depth++; }
+        ~JoinDepthScope() { join_depth--; }
+};
+
 /*
  * ================================================================
  * Serial task system implementation
@@ -25,20 +86,23 @@ const char* TaskSystemSerial::name() {
 }
 
 TaskSystemSerial::TaskSystemSerial(int num_threads)
-    : ITaskSystem(num_threads) {}
+    : ITaskSystem(num_threads), contexts(1) {}
 
 TaskSystemSerial::~TaskSystemSerial() {}
 
 void TaskSystemSerial::run(IRunnable* runnable, int num_total_tasks) {
-    for (int i = 0; i < num_total_tasks; i++) {
-        runnable->runTask(i, num_total_tasks);
+    ContextScope context(contexts[0]);
+    RangeAdapter adapter;
+    if (num_total_tasks > 0) {
+        adapter.bind(runnable)->runRange(0, num_total_tasks, num_total_tasks);
     }
 }
 
 TaskID TaskSystemSerial::runAsyncWithDeps(IRunnable* runnable,
                                           int num_total_tasks,
                                           const std::vector<TaskID>& deps) {
-    // You do not need to implement this method.
+    // launches run synchronously, so every dep is already done
+    run(runnable, num_total_tasks);
     return 0;
 }
 
@@ -47,6 +111,10 @@ void TaskSystemSerial::sync() {
     return;
 }
 
+int TaskSystemSerial::numWorkerContexts() {
+    return contexts.size();
+}
+
 /*
  * ================================================================
  * Parallel Task System Implementation
@@ -58,7 +126,8 @@ const char* TaskSystemParallelSpawn::name() {
 }
 
 TaskSystemParallelSpawn::TaskSystemParallelSpawn(int num_threads)
-    : ITaskSystem(num_threads), num_threads(num_threads) {
+    : ITaskSystem(num_threads), num_threads(num_threads),
+      contexts(num_threads) {
     //
     // TODO: CS149 student implementations may decide to perform setup
     // operations (such as thread pool construction) here.
@@ -77,18 +146,49 @@ void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
     // tasks sequentially on the calling thread.
     //
 
+    // a nested launch and the ids skipped after a throw go through the range
+    RangeAdapter adapter;
+    IRangeRunnable* range = adapter.bind(runnable);
+
+    // from inside a task, spawning another set of threads per level of
+    // nesting would only oversubscribe, the calling thread does it alone
+    if (current_pool == this) {
+        if (num_total_tasks > 0) {
+            range->runRange(0, num_total_tasks, num_total_tasks);
+        }
+        return;
+    }
+
     std::atomic_int num_finished{0};
+    // the first exception a task threw, rethrown once every thread is done
+    std::exception_ptr error;
+    std::mutex error_mu;
 
     std::vector<std::thread> threads{};
     for (int i = 0; i < num_threads; i++) {
 
-        threads.push_back(std::thread([&]() {
+        threads.push_back(std::thread([&, i]() {
+            PoolScope scope(this);
+            ContextScope context(contexts[i]);
             while (true) {
                 int num = num_finished.fetch_add(1);
-                if (num > num_total_tasks) {
+                if (num >= num_total_tasks) {
                     break;
                 }
-                runnable->runTask(num, num_total_tasks);
+                try {
+                    runnable->runTask(num, num_total_tasks);
+                } catch (...) {
+                    std::scoped_lock<std::mutex> lck{error_mu};
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    // nobody claims the tasks left
+                    int unclaimed = num_finished.exchange(num_total_tasks);
+                    if (unclaimed < num_total_tasks) {
+                        range->skipRange(unclaimed, num_total_tasks,
+                                         num_total_tasks);
+                    }
+                }
             }
         }));
     }
@@ -96,11 +196,15 @@ void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
     for (auto& thread : threads) {
         thread.join();
     }
+    if (error) {
+        std::rethrow_exception(error);
+    }
 }
 
 TaskID TaskSystemParallelSpawn::runAsyncWithDeps(
     IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) {
-    // You do not need to implement this method.
+    // launches run synchronously, so every dep is already done
+    run(runnable, num_total_tasks);
     return 0;
 }
 
@@ -109,6 +213,88 @@ void TaskSystemParallelSpawn::sync() {
     return;
 }
 
+int TaskSystemParallelSpawn::numWorkerContexts() {
+    return contexts.size();
+}
+
+int chunkSize(const PoolConfig& config, int launch_grain, int remaining,
+              int num_workers, int64_t ns_per_task) {
+    if (launch_grain > 0) {
+        return launch_grain;
+    }
+    int grain = std::max(config.grain_size, 1);
+    switch (config.grain_policy) {
+        case GrainPolicy::Fixed:
+            return grain;
+        case GrainPolicy::Guided:
+            return std::max(grain, remaining / (2 * num_workers));
+        case GrainPolicy::Adaptive: {
+            if (ns_per_task <= 0) {
+                // nothing measured yet, run a small probe chunk
+                return grain;
+            }
+            int64_t target = int64_t{config.target_chunk_us} * 1000 /
+                             ns_per_task;
+            // never take so much that other workers are left idle
+            int64_t fair = (remaining + num_workers - 1) / num_workers;
+            return (int)std::clamp<int64_t>(target, grain,
+                                            std::max<int64_t>(grain, fair));
+        }
+    }
+    return grain;
+}
+
+static int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/*
+ * Runs tasks [begin, end) of a launch. With `ns_per_task` set, the chunk is
+ * timed and folded into the running per-task estimate of the launch.
+ */
+static void runTasks(IRangeRunnable* range, int begin, int end,
+                     int num_total_tasks, std::atomic<int64_t>* ns_per_task) {
+    if (ns_per_task == nullptr) {
+        range->runRange(begin, end, num_total_tasks);
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    range->runRange(begin, end, num_total_tasks);
+    int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+    int64_t sample = std::max<int64_t>(elapsed / (end - begin), 1);
+    // racy moving average, losing an update now and then is fine
+    int64_t old = ns_per_task->load(std::memory_order_relaxed);
+    ns_per_task->store(old == 0 ? sample : (3 * old + sample) / 4,
+                       std::memory_order_relaxed);
+}
+
+/*
+ * The CPU for each of `num_workers` pool workers as `config.affinity` asks,
+ * empty if they are not pinned. The thread calling run() or sync() is not
+ * the pool's to move, it stays where it is.
+ */
+static std::vector<int> workerPlacement(const PoolConfig& config,
+                                        int num_workers) {
+    if (config.affinity.policy == AffinityPolicy::None) {
+        return {};
+    }
+    static const CpuTopology topology = CpuTopology::detect();
+    return placeWorkers(config.affinity, topology, num_workers);
+}
+
+static void pinWorkers(std::vector<std::thread>& threads,
+                       const PoolConfig& config) {
+    std::vector<int> placement = workerPlacement(config, threads.size());
+    for (size_t i = 0; i < placement.size(); i++) {
+        pinThread(threads[i], placement[i]);
+    }
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Spinning Task System Implementation
@@ -120,16 +306,24 @@ const char* TaskSystemParallelThreadPoolSpinning::name() {
 }
 
 TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(
-    int num_threads)
+    int num_threads, const PoolConfig& config)
     : ITaskSystem(num_threads),
+      config(config),
+
       num_threads(num_threads),
       threads(std::vector<std::thread>{}),
+      contexts(num_threads + 1),
 
       num_finished(std::atomic_int{0}),
-      num_started(std::atomic_int{0}),
+      num_started(0),
 
       _runnable(nullptr),
       _num_total_tasks(-1),
+      _grain_size(0),
+      ns_per_task(0),
+      error(nullptr),
+
+      generation(0),
 
       mu(std::mutex{}),
       shutdown(false) {
@@ -140,38 +334,92 @@ TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(
     // (requiring changes to tasksys.h).
     //
     for (int i = 0; i < num_threads; i++) {
-        threads.emplace_back([this]() {
+        threads.emplace_back([this, i]() {
+            uint64_t seen = 0;
             while (true) {
-                {
-                    std::scoped_lock<std::mutex> lck{mu};
-                    if (shutdown) {
-                        break;
-                    }
-                    if (_runnable == nullptr) {
-                        continue;
-                    }
+                waitUntil(this->config.worker_wait, work_event, [this, &seen] {
+                    return shutdown.load() || generation.load() != seen;
+                });
+                if (shutdown) {
+                    break;
                 }
+                seen = generation.load();
+                runClaimed(i);
+            }
+        });
+    }
+    pinWorkers(threads, this->config);
+}
 
-                if (num_finished > _num_total_tasks) {
-                    continue;
-                }
+int TaskSystemParallelThreadPoolSpinning::claimIds(uint64_t launch,
+                                                   int grain,
+                                                   int num_total_tasks) {
+    uint64_t started = num_started.load();
+    while (true) {
+        int current = static_cast<uint32_t>(started);
+        if (started >> 32 != (launch & 0xffffffff) ||
+            current >= num_total_tasks) {
+            return num_total_tasks;
+        }
+        int end = std::min<int64_t>(int64_t{current} + grain, num_total_tasks);
+        if (num_started.compare_exchange_weak(
+                started, (started & ~uint64_t{0xffffffff}) | uint32_t(end))) {
+            return current;
+        }
+    }
+}
 
-                int current = 0;
-                while ((current = num_started.fetch_add(1)) <
-                       _num_total_tasks) {
-                    _runnable->runTask(current, _num_total_tasks);
-                    num_finished.fetch_add(1);
+void TaskSystemParallelThreadPoolSpinning::runClaimed(int index) {
+    PoolScope scope(this);
+    ContextScope context(contexts[index]);
+
+    // run() only replaces these once every claimed id of the launch is
+    // counted, so they belong to `launch` for as long as claims succeed
+    uint64_t launch = generation.load(std::memory_order_acquire);
+    IRangeRunnable* runnable = _runnable.load(std::memory_order_relaxed);
+    int num_total_tasks = _num_total_tasks.load(std::memory_order_relaxed);
+    int grain_size      = _grain_size.load(std::memory_order_relaxed);
+
+    bool adaptive =
+        config.grain_policy == GrainPolicy::Adaptive && grain_size == 0;
+    while (true) {
+        // the thread in run() works too, hence num_threads + 1
+        int started = static_cast<uint32_t>(num_started.load());
+        int grain   = chunkSize(config, grain_size, num_total_tasks - started,
+                                num_threads + 1, ns_per_task.load());
+        int current = claimIds(launch, grain, num_total_tasks);
+        if (current >= num_total_tasks) {
+            break;
+        }
+        int end   = std::min(current + grain, num_total_tasks);
+        int count = end - current;
+        try {
+            runTasks(runnable, current, end, num_total_tasks,
+                     adaptive ? &ns_per_task : nullptr);
+        } catch (...) {
+            {
+                std::scoped_lock<std::mutex> lck{mu};
+                if (!error) {
+                    error = std::current_exception();
                 }
             }
-        });
+            // task ids nobody claimed yet are skipped, but counted here
+            int unclaimed = claimIds(launch, num_total_tasks, num_total_tasks);
+            if (unclaimed < num_total_tasks) {
+                runnable->skipRange(unclaimed, num_total_tasks,
+                                    num_total_tasks);
+                count += num_total_tasks - unclaimed;
+            }
+        }
+        if (num_finished.fetch_add(count) + count == num_total_tasks) {
+            done_event.notifyAll();
+        }
     }
 }
 
 TaskSystemParallelThreadPoolSpinning::~TaskSystemParallelThreadPoolSpinning() {
-    {
-        std::scoped_lock<std::mutex> lck{mu};
-        shutdown = true;
-    }
+    shutdown = true;
+    work_event.notifyAll();
     for (auto& thread : threads) {
         thread.join();
     }
@@ -179,6 +427,12 @@ TaskSystemParallelThreadPoolSpinning::~TaskSystemParallelThreadPoolSpinning() {
 
 void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable,
                                                int num_total_tasks) {
+    run(runnable, num_total_tasks, LaunchOptions{});
+}
+
+void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable,
+                                               int num_total_tasks,
+                                               const LaunchOptions& options) {
 
     //
     // TODO: CS149 students will modify the implementation of this
@@ -186,27 +440,56 @@ void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable,
     // tasks sequentially on the calling thread.
     //
 
+    // the pool only holds one launch at a time, a launch from inside one
+    // of its tasks runs on the calling thread
+    if (current_pool == this) {
+        RangeAdapter adapter;
+        runTasks(adapter.bind(runnable), 0, num_total_tasks, num_total_tasks,
+                 nullptr);
+        return;
+    }
+
     {
         std::scoped_lock<std::mutex> lck{mu};
-        _runnable = runnable;
-        _num_total_tasks = num_total_tasks;
+        _runnable.store(_adapter.bind(runnable), std::memory_order_relaxed);
+        _num_total_tasks.store(num_total_tasks, std::memory_order_relaxed);
+        _grain_size.store(options.grain_size, std::memory_order_relaxed);
+        ns_per_task.store(0);
         num_finished.store(0);
-        num_started.store(0);
+        uint64_t launch = generation.load() + 1;
+        num_started.store(launch << 32);
+        generation.store(launch, std::memory_order_release);
     }
 
-    while (num_finished < num_total_tasks) {}
+    // a launch that fits in one chunk is run right here, without waking
+    // anyone up
+    int first_chunk = chunkSize(config, options.grain_size, num_total_tasks,
+                                num_threads + 1, 0);
+    if (first_chunk < num_total_tasks) {
+        work_event.notifyAll();
+    }
+    runClaimed(num_threads);
+
+    // a worker late for this launch may still read its fields but cannot
+    // claim anything, the runnable is not touched once this returns
+    waitUntil(config.caller_wait, done_event, [this, num_total_tasks] {
+        return num_finished.load() >= num_total_tasks;
+    });
 
-    // it is very tricky to determine whether all jobs have been finished
+    std::exception_ptr failed;
     {
         std::scoped_lock<std::mutex> lck{mu};
-        _runnable = nullptr;
-        _num_total_tasks = -1;
+        failed = std::exchange(error, nullptr);
+    }
+    if (failed) {
+        std::rethrow_exception(failed);
     }
 }
 
 TaskID TaskSystemParallelThreadPoolSpinning::runAsyncWithDeps(
     IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) {
-    // You do not need to implement this method.
+    // launches run synchronously, so every dep is already done
+    run(runnable, num_total_tasks);
     return 0;
 }
 
@@ -215,30 +498,125 @@ void TaskSystemParallelThreadPoolSpinning::sync() {
     return;
 }
 
+int TaskSystemParallelThreadPoolSpinning::numWorkerContexts() {
+    return contexts.size();
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Sleeping Task System Implementation
  * ================================================================
  */
 
+
+PoolConfig PoolConfig::fromEnv() {
+    PoolConfig config;
+    if (const char* sched = std::getenv("TASKSYS_SCHEDULER")) {
+        if (std::strcmp(sched, "global") == 0) {
+            config.scheduler = SchedulerMode::GlobalQueue;
+        } else if (std::strcmp(sched, "steal") == 0) {
+            config.scheduler = SchedulerMode::WorkStealing;
+        }
+    }
+    if (const char* order = std::getenv("TASKSYS_ORDER")) {
+        const char* arg = std::strchr(order, ':');
+        size_t len      = arg ? arg - order : std::strlen(order);
+        if (std::strncmp(order, "fifo", len) == 0) {
+            config.ready_order = ReadyOrder::Fifo;
+        } else if (std::strncmp(order, "cpath", len) == 0) {
+            config.ready_order = ReadyOrder::CriticalPath;
+        }
+        if (arg != nullptr && std::strcmp(arg + 1, "tasks") == 0) {
+            config.cost_model = CostModel::Tasks;
+        } else if (arg != nullptr && std::strcmp(arg + 1, "measured") == 0) {
+            config.cost_model = CostModel::Measured;
+        }
+    }
+    if (const char* grain = std::getenv("TASKSYS_GRAIN")) {
+        const char* arg = std::strchr(grain, ':');
+        size_t len      = arg ? arg - grain : std::strlen(grain);
+        if (std::strncmp(grain, "fixed", len) == 0) {
+            config.grain_policy = GrainPolicy::Fixed;
+        } else if (std::strncmp(grain, "guided", len) == 0) {
+            config.grain_policy = GrainPolicy::Guided;
+        } else if (std::strncmp(grain, "adaptive", len) == 0) {
+            config.grain_policy = GrainPolicy::Adaptive;
+        }
+        if (arg != nullptr) {
+            if (config.grain_policy == GrainPolicy::Adaptive) {
+                config.target_chunk_us = std::max(std::atoi(arg + 1), 1);
+            } else {
+                config.grain_size = std::max(std::atoi(arg + 1), 1);
+            }
+        }
+    }
+    if (const char* affinity = std::getenv("TASKSYS_AFFINITY")) {
+        config.affinity = Affinity::parse(affinity);
+    }
+    if (const char* wait = std::getenv("TASKSYS_WAIT")) {
+        WaitStrategy strategy;
+        strategy.spin_us = std::max(std::atoi(wait), 0);
+        if (const char* arg = std::strchr(wait, ':')) {
+            strategy.yield_us = std::atoi(arg + 1);
+        }
+        config.worker_wait = strategy;
+        config.caller_wait = strategy;
+    }
+    if (const char* limit = std::getenv("TASKSYS_MAX_PENDING")) {
+        config.max_pending_launches = std::max(std::atoi(limit), 0);
+        if (const char* arg = std::strchr(limit, ':')) {
+            config.max_pending_tasks = std::max(std::atoll(arg + 1), 0LL);
+        }
+    }
+    if (const char* aging = std::getenv("TASKSYS_PRIORITY_AGING")) {
+        config.priority_aging_us = std::max(std::atoi(aging), 0);
+    }
+    if (const char* elastic = std::getenv("TASKSYS_ELASTIC")) {
+        config.min_workers = std::atoi(elastic);
+        if (const char* arg = std::strchr(elastic, ':')) {
+            config.grow_after_us = std::max(std::atoi(arg + 1), 0);
+            if (const char* next = std::strchr(arg + 1, ':')) {
+                config.retire_after_ms = std::max(std::atoi(next + 1), 0);
+            }
+        }
+    }
+    return config;
+}
+
 const char* TaskSystemParallelThreadPoolSleeping::name() {
     return "Parallel + Thread Pool + Sleep";
 }
 
 TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(
-    int num_threads)
+    int num_threads, const PoolConfig& config)
     : ITaskSystem(num_threads),
       mu(std::mutex{}),
-      start_cv(std::condition_variable{}),
-      finish_cv(std::condition_variable{}),
+
+      config(config),
+
+      next_seq(0),
+      num_ready(0),
+      num_pending(0),
+      pending_tasks(0),
+
+      ns_per_task_any(0),
+
+      num_lanes(1),
+
+      num_injected(0),
+      num_injected_high(0),
+      caller_busy(false),
 
       num_threads(num_threads),
-      threads(std::vector<std::thread>{}),
+      threads(num_threads),
+      placement(workerPlacement(config, num_threads)),
 
-      _runnable(nullptr),
-      _num_total_tasks(-1),
+      num_workers(0),
+      worker_running(num_threads, false),
+      size_start_ns(nowNs()),
+
+      contexts(num_threads + 1),
 
-      has_work(false),
       shutdown(false) {
     //
     // TODO: CS149 student implementations may decide to perform setup
@@ -246,66 +624,22 @@ TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(
     // Implementations are free to add new class member variables
     // (requiring changes to tasksys.h).
     //
-    
-    
-   
-   
-    daemon = std::thread {[this]() {
-        while (true) {
-            {
-                std::scoped_lock<std::mutex> lck {mu};
-                if (shutdown) {
-                    break;
-                }
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
-    }};
-    
-    
-    
-    
-    
-    
 
-    for (int i = 0; i < num_threads; i++) {
-        threads.emplace_back([this]() {
-            while (true) {
-                {
-                    // std::unique_lock<std::mutex> lck{mu};
-                    // start_cv.wait(lck, [this] { return shutdown; });
-                    // if (shutdown) {
-                    //     break;
-                    // }
-                }
-                int current;
-                // possible optimization here, use atomic instead of mutex
-                IRunnable* runnable;
-                int num_total_tasks;
-                {
-                    std::scoped_lock<std::mutex> lck {mu};
-                    if (!ready_tasks.empty()) {
-                        auto it = std::ranges::find_if(ready_tasks, [](Task task) {
-                            return task.num_started < task.num_total_tasks;
-                        });
-                        if (it == ready_tasks.end()) {
-                            // this is an extreme condition when all tasks are running
-                            continue;
-                        }
-                        Task& task = *it; 
-                        current = task.num_started;
-                        task.num_started++;
-                        runnable = task.runnable;
-                        num_total_tasks = task.num_total_tasks;
-                    }
-                }
-                
-                runnable->runTask(current, num_total_tasks);
-                
-                
+    if (config.scheduler == SchedulerMode::WorkStealing) {
+        // one deque per worker plus one for the thread in run() / sync()
+        for (int i = 0; i <= num_threads; i++) {
+            deques.emplace_back(std::make_unique<WorkDeque>());
+        }
+    }
 
-            }
-        });
+    std::scoped_lock<std::mutex> lck{size_mu};
+    int first_workers = elastic() ? config.min_workers : num_threads;
+    for (int i = 0; i < first_workers; i++) {
+        startWorker(i);
+    }
+    recordPoolSize(size_start_ns);
+    if (elastic()) {
+        sizer = std::thread([this]() { sizerLoop(); });
     }
 }
 
@@ -316,65 +650,1927 @@ TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
     // Implementations are free to add new class member variables
     // (requiring changes to tasksys.h).
     //
+    shutdown = true;
+    work_event.notifyAll();
+    // the sizer starts no workers from here on
+    sizer_event.notifyAll();
+    if (sizer.joinable()) {
+        sizer.join();
+    }
+    for (auto& thread : threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+/*
+ * Starts the worker with `index`, whose last thread, if any, has exited.
+ * Called with size_mu held.
+ */
+void TaskSystemParallelThreadPoolSleeping::startWorker(int index) {
+    if (threads[index].joinable()) {
+        threads[index].join();
+    }
+    if (config.scheduler == SchedulerMode::GlobalQueue) {
+        threads[index] =
+            std::thread([this, index]() { globalWorkerLoop(index); });
+    } else {
+        threads[index] = std::thread([this, index]() { workerLoop(index); });
+    }
+    if (!placement.empty()) {
+        pinThread(threads[index], placement[index]);
+    }
+    worker_running[index] = true;
+    num_workers.fetch_add(1);
+}
+
+/*
+ * Lets the idle worker with `index` exit, unless the pool is down to
+ * min_workers or shutting down. Returns whether it may.
+ */
+bool TaskSystemParallelThreadPoolSleeping::retireWorker(int index) {
+    {
+        std::scoped_lock<std::mutex> lck{size_mu};
+        if (shutdown.load() || num_workers.load() <= config.min_workers) {
+            return false;
+        }
+        worker_running[index] = false;
+        num_workers.fetch_sub(1);
+        size_stats.num_retired++;
+        recordPoolSize(nowNs());
+    }
+    // work that came in while it gave up may have woken it and nobody else
+    if (hasBacklog()) {
+        notifyWork();
+    }
+    return true;
+}
+
+// adds the current worker count to the history, called with size_mu held
+void TaskSystemParallelThreadPoolSleeping::recordPoolSize(int64_t now) {
+    int count               = num_workers.load();
+    size_stats.num_workers  = count;
+    size_stats.peak_workers = std::max(size_stats.peak_workers, count);
+    size_stats.history.push_back(PoolSizeSample{now - size_start_ns, count});
+    if (size_stats.history.size() > PoolSizeStats::kMaxHistory) {
+        size_stats.history.pop_front();
+    }
+}
+
+/*
+ * Whether ready work is queued that no worker took yet. In WorkStealing
+ * mode items behind the one a worker runs count too, any idle worker could
+ * steal them. A racy hint.
+ */
+bool TaskSystemParallelThreadPoolSleeping::hasBacklog() {
+    if (config.scheduler == SchedulerMode::GlobalQueue) {
+        return num_ready.load() > 0;
+    }
+    if (num_injected.load() > 0) {
+        return true;
+    }
+    for (auto& deque : deques) {
+        if (!deque->empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * The sizer of an elastic pool. It checks for a backlog every quarter of
+ * grow_after_us and adds a worker once it found one on every check for
+ * grow_after_us, right away if no worker runs at all. It parks while there
+ * is no backlog or no room for another worker. wakeSizer() wakes it when
+ * new work found no parked worker or a worker saw more work queued than
+ * it took, and it looks on its own every 16 grow_after_us, for workers
+ * stuck in long tasks while a submitter's notify went to one of them.
+ */
+void TaskSystemParallelThreadPoolSleeping::sizerLoop() {
+    auto tick = std::chrono::microseconds(
+        std::max(config.grow_after_us / 4, 50));
+    auto growing = [this] {
+        return num_workers.load() < num_threads && hasBacklog();
+    };
+
+    while (true) {
+        waitFor(WaitStrategy{0, 0}, sizer_event,
+                [&] { return shutdown.load() || growing(); }, 64 * tick);
+        if (shutdown) {
+            break;
+        }
+
+        int64_t backlog_since = nowNs();
+        while (!shutdown.load() && growing()) {
+            int64_t now = nowNs();
+            if (num_workers.load() == 0 ||
+                now - backlog_since >= config.grow_after_us * int64_t(1000)) {
+                std::scoped_lock<std::mutex> lck{size_mu};
+                if (shutdown.load()) {
+                    break;
+                }
+                int index = 0;
+                while (worker_running[index]) {
+                    index++;
+                }
+                startWorker(index);
+                size_stats.num_grown++;
+                recordPoolSize(now);
+                backlog_since = now;
+            }
+            std::this_thread::sleep_for(tick);
+        }
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::globalWorkerLoop(int index) {
+    PoolScope scope(this);
+    ContextScope context(contexts[index]);
+    auto idle = elastic() ? std::chrono::nanoseconds(std::chrono::milliseconds(
+                                config.retire_after_ms))
+                          : std::chrono::nanoseconds::max();
+    while (true) {
+        bool ready = waitFor(
+            config.worker_wait, work_event,
+            [this] { return shutdown.load() || num_ready.load() > 0; }, idle);
+        if (shutdown) {
+            break;
+        }
+        if (!ready) {
+            if (retireWorker(index)) {
+                break;
+            }
+            continue;
+        }
+        runGlobalChunk();
+    }
+}
+
+bool TaskSystemParallelThreadPoolSleeping::runGlobalChunk() {
+    WorkItem item;
+    bool more;
     {
         std::scoped_lock<std::mutex> lck{mu};
-        shutdown = true;
+        if (num_ready.load() <= 0) {
+            // another worker got there first
+            return false;
+        }
+        bool by_level = config.ready_order == ReadyOrder::CriticalPath;
+        if (!by_level) {
+            drainReady();
+        }
+        // launches are dropped from the ready queue once their last task
+        // id is claimed, so the next one always has work left
+        int c = picker.pick(
+            [&](int c) {
+                return by_level ? !ready_heap[c].empty()
+                                : !ready_tasks[c].empty();
+            },
+            config.priority_aging_us * int64_t(1000), nowNs);
+        if (c < 0) {
+            // counted, but queued in ready_inbox behind one still on its
+            // way in
+            return false;
+        }
+        item = claimChunk(by_level ? ready_heap[c].top()
+                                   : ready_tasks[c].front());
+        if (item.end == item.task->num_total_tasks) {
+            if (by_level) {
+                ready_heap[c].pop();
+            } else {
+                ready_tasks[c].pop_front();
+            }
+            num_ready.fetch_sub(1);
+        }
+        // a worker woken for the work left may not have got to it yet
+        more = num_ready.load() > 0;
     }
-    start_cv.notify_all();
-    for (auto& thread : threads) {
-        thread.join();
+    if (more) {
+        wakeSizer();
+    }
+
+    runGlobalItem(item);
+    return true;
+}
+
+// the next chunk of queued launch `task`, with mu held
+WorkItem TaskSystemParallelThreadPoolSleeping::claimChunk(Task* task) {
+    int current = task->num_started;
+    // a cancelled launch hands out all of its ids at once, to be skipped
+    int end = task->cancelled.load(std::memory_order_relaxed)
+                  ? task->num_total_tasks
+                  : std::min(current + chunkSize(config, task->grain_size,
+                                                 task->num_total_tasks -
+                                                     current,
+                                                 num_threads,
+                                                 task->ns_per_task.load()),
+                             task->num_total_tasks);
+    task->num_started = end;
+    return WorkItem{task, current, end};
+}
+
+/*
+ * Claims a chunk of `task` wherever it is queued, if it still has launch
+ * `task_id` in it.
+ */
+bool TaskSystemParallelThreadPoolSleeping::claimLaunchChunk(Task* task,
+                                                            TaskID task_id,
+                                                            WorkItem& item) {
+    bool more;
+    {
+        std::scoped_lock<std::mutex> lck{mu};
+        bool by_level = config.ready_order == ReadyOrder::CriticalPath;
+        // a queued launch is not done, its record is not reused and keeps
+        // its id
+        bool queued = by_level && task->queued;
+        if (!by_level) {
+            drainReady();
+            for (const FairQueue<Task*>& tasks : ready_tasks) {
+                queued = queued || tasks.contains(task);
+            }
+        }
+        if (!queued || task->id.load(std::memory_order_relaxed) != task_id) {
+            return false;
+        }
+        item = claimChunk(task);
+        if (item.end == task->num_total_tasks) {
+            if (by_level) {
+                ready_heap[task->priority].erase(task);
+            } else {
+                ready_tasks[task->priority].erase(task);
+            }
+            num_ready.fetch_sub(1);
+        }
+        more = num_ready.load() > 0;
     }
+    if (more) {
+        wakeSizer();
+    }
+    return true;
 }
 
-void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable,
-                                               int num_total_tasks) {
-    //
-    // TODO: CS149 students will modify the implementation of this
-    // method in Parts A and B.  The implementation provided below runs all
-    // tasks sequentially on the calling thread.
-    //
+void TaskSystemParallelThreadPoolSleeping::runGlobalItem(WorkItem item) {
+    Task* task = item.task;
+    // ids of a cancelled launch are skipped but still count as finished
+    if (!task->cancelled.load(std::memory_order_relaxed)) {
+        runChunk(task, item.begin, item.end);
+    } else {
+        task->range->skipRange(item.begin, item.end, task->num_total_tasks);
+    }
 
-    // {
-    //     std::scoped_lock<std::mutex> lck{mu};
-    //     _runnable = runnable;
-    //     _num_total_tasks = num_total_tasks;
-    //     num_finished = 0;
-    //     work_finished = false;
-    //     has_work = true;
-    // }
-    // start_cv.notify_all();
+    // once another thread counts the last chunk, the record may go to the
+    // next launch, its task count is read before counting
+    int count           = item.end - item.begin;
+    int num_total_tasks = task->num_total_tasks;
+    if (task->num_finished.fetch_add(count) + count == num_total_tasks) {
+        finishLaunch(task, nullptr);
+    }
+}
 
-    // while (num_finished < _num_total_tasks) {
-    //     // TODO: somehow if I all this sleep it will not work, WHY?
-    //     // std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    // }
+void TaskSystemParallelThreadPoolSleeping::workerLoop(int index) {
+    PoolScope scope(this, index);
+    ContextScope context(contexts[index]);
+    WorkDeque& local = *deques[index];
+    std::minstd_rand rng(index + 1);
+    auto idle = elastic() ? std::chrono::nanoseconds(std::chrono::milliseconds(
+                                config.retire_after_ms))
+                          : std::chrono::nanoseconds::max();
 
-    // {
-    //     std::scoped_lock<std::mutex> lck {mu};
-    //     has_work = false;
-    // }
+    while (true) {
+        WorkItem item;
+        bool found = false;
+        bool ready = waitFor(
+            config.worker_wait, work_event,
+            [&] {
+                if (shutdown.load()) {
+                    return true;
+                }
+                found = findWork(index, rng, item);
+                return found;
+            },
+            idle);
+        if (shutdown) {
+            break;
+        }
+        if (!ready) {
+            // its deque is empty and only it pushes there
+            if (retireWorker(index)) {
+                break;
+            }
+            continue;
+        }
+        if (num_injected.load(std::memory_order_relaxed) > 0) {
+            wakeSizer();
+        }
+        runItem(local, item);
+    }
 }
 
-TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(
-    IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) {
+bool TaskSystemParallelThreadPoolSleeping::findWork(int index,
+                                                    std::minstd_rand& rng,
+                                                    WorkItem& item) {
+    // high priority launches go ahead of the worker's own work
+    if (num_injected_high.load(std::memory_order_relaxed) > 0 &&
+        takeInjected(item)) {
+        return true;
+    }
+    if (deques[index]->take(item)) {
+        return true;
+    }
+    if (num_injected.load() > 0 && takeInjected(item)) {
+        return true;
+    }
 
-    //
-    // TODO: CS149 students will implement this method in Part B.
-    //
-    std::scoped_lock<std::mutex> lck {mu};
-    TaskID task_id = next_task_id;
-    next_task_id += 1;
-    // some optimizition possible here, we are copying memory  
-    Task task = Task {.id=task_id, .runnable=runnable, .num_total_tasks=num_total_tasks};
-    waiting_tasks.emplace_back(WaitTask{.waiting_for=deps, .task=task});
-    return task_id;
+    // visit every other worker starting from a random victim, a victim
+    // that lost a race against another thief is retried
+    int num_deques = deques.size();
+    if (num_deques > 1) {
+        int start = rng() % num_deques;
+        for (int k = 0; k < num_deques; k++) {
+            int victim = (start + k) % num_deques;
+            if (victim == index) {
+                continue;
+            }
+            WorkDeque::StealResult result;
+            do {
+                result = deques[victim]->steal(item);
+            } while (result == WorkDeque::StealResult::Abort);
+            if (result == WorkDeque::StealResult::Success) {
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
-void TaskSystemParallelThreadPoolSleeping::sync() {
+/*
+ * Takes the next item from the injection queues, or from the ready heaps
+ * with the critical path order, picking the priority class by `picker`.
+ */
+bool TaskSystemParallelThreadPoolSleeping::takeInjected(WorkItem& item) {
+    bool by_level = config.ready_order == ReadyOrder::CriticalPath;
+    std::scoped_lock<std::mutex> lck{inject_mu};
+    drainInjected();
+    int c = picker.pick(
+        [&](int c) {
+            return !injection[c].empty() || (by_level && !ready_heap[c].empty());
+        },
+        config.priority_aging_us * int64_t(1000), nowNs);
+    if (c < 0) {
+        return false;
+    }
+    // with the critical path order, injection only holds task ids of
+    // element-wise launches that already started
+    if (!injection[c].empty()) {
+        item = injection[c].front();
+        injection[c].pop_front();
+    } else {
+        Task* task = ready_heap[c].top();
+        ready_heap[c].pop();
+        item = WorkItem{task, 0, task->num_total_tasks};
+    }
+    num_injected.fetch_sub(1, std::memory_order_relaxed);
+    if (c == static_cast<int>(LaunchPriority::High)) {
+        num_injected_high.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return true;
+}
 
-    //
-    // TODO: CS149 students will modify the implementation of this method in Part B.
-    //
+// marks a successor list as closed, i.e. the launch is done
+static Edge closed_marker;
+static Edge* const kClosed = &closed_marker;
 
-    return;
+// low bit of a successor list head, set once the launch is released
+static constexpr uintptr_t kReleased = 1;
+
+static bool isReleased(Edge* head) {
+    return reinterpret_cast<uintptr_t>(head) & kReleased;
+}
+
+static Edge* untagged(Edge* head) {
+    return reinterpret_cast<Edge*>(reinterpret_cast<uintptr_t>(head) &
+                                   ~kReleased);
+}
+
+static Edge* tagged(Edge* edge, bool released) {
+    return reinterpret_cast<Edge*>(reinterpret_cast<uintptr_t>(edge) |
+                                   (released ? kReleased : 0));
+}
+
+// a launch is done once finishLaunch() closed its successor list
+static bool isFinished(const Task* task) {
+    return task->successors.load(std::memory_order_acquire) == kClosed;
+}
+
+// the launch's queue in ready_tasks or injection
+static int laneOf(const Task* task) {
+    return task->stream != nullptr ? task->stream->lane : 0;
+}
+
+/*
+ * A TaskID is the slot of the launch's record in the low 32 bits and the
+ * record's generation above, bumped every time the record is reused. Ids
+ * of earlier launches in the same slot then name nothing, which means done.
+ */
+static constexpr int kSlotBits = 32;
+
+static TaskID nextTaskID(TaskID previous, uint32_t slot) {
+    // 31 bits of generation keep ids positive
+    uint64_t generation = ((previous >> kSlotBits) + 1) & 0x7fffffff;
+    return static_cast<TaskID>(generation << kSlotBits | slot);
+}
+
+// what submit() returns when the launch has to wait for room, never an id
+static constexpr TaskID kNoRoom = -1;
+
+static void markReleased(Task* task) {
+    Edge* head = task->successors.load(std::memory_order_relaxed);
+    while (head != kClosed && !isReleased(head) &&
+           !task->successors.compare_exchange_weak(
+               head, tagged(head, true), std::memory_order_acq_rel,
+               std::memory_order_relaxed)) {
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::runItem(WorkDeque& local,
+                                                   WorkItem item) {
+    Task* task = item.task;
+    // ids of a cancelled launch are skipped but still count as finished
+    if (!task->cancelled.load(std::memory_order_relaxed)) {
+        int grain = chunkSize(
+            config, task->grain_size,
+            task->num_total_tasks -
+                task->num_finished.load(std::memory_order_relaxed),
+            num_threads, task->ns_per_task.load(std::memory_order_relaxed));
+
+        // keep one chunk and leave the rest to be stolen
+        while (item.end - item.begin > grain) {
+            int mid = item.begin + (item.end - item.begin) / 2;
+            local.push(WorkItem{task, mid, item.end});
+            notifyWork();
+            item.end = mid;
+        }
+
+        runChunk(task, item.begin, item.end);
+    } else {
+        task->range->skipRange(item.begin, item.end, task->num_total_tasks);
+    }
+
+    // the list cannot be closed yet, that takes this chunk to be counted
+    if (task->has_elementwise_successors.load(std::memory_order_relaxed)) {
+        for (Edge* edge = untagged(
+                 task->successors.load(std::memory_order_acquire));
+             edge != nullptr; edge = edge->next) {
+            if (edge->elementwise) {
+                releaseIds(edge->successor, item.begin, item.end, &local);
+            }
+        }
+    }
+
+    int count           = item.end - item.begin;
+    int num_total_tasks = task->num_total_tasks;
+    if (task->num_finished.fetch_add(count) + count == num_total_tasks) {
+        finishLaunch(task, &local);
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::runChunk(Task* task, int begin,
+                                                    int end) {
+    // a sync() from these tasks waits for what they launch from here on
+    size_t outer_scope = nested_scope;
+    nested_scope       = nested_launches.size();
+
+    if (!task->started.load(std::memory_order_relaxed) &&
+        !task->started.exchange(true, std::memory_order_relaxed)) {
+        wait_stats[task->priority].record(nowNs() - task->ready_ns);
+    }
+
+    bool adaptive = config.grain_policy == GrainPolicy::Adaptive &&
+                    task->grain_size == 0;
+    try {
+        if (task->type == nullptr) {
+            runTasks(task->range, begin, end, task->num_total_tasks,
+                     adaptive ? &task->ns_per_task : nullptr);
+        } else {
+            auto start = std::chrono::steady_clock::now();
+            runTasks(task->range, begin, end, task->num_total_tasks,
+                     adaptive ? &task->ns_per_task : nullptr);
+            task->busy_ns.fetch_add(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count(),
+                std::memory_order_relaxed);
+        }
+    } catch (...) {
+        // the rest of the chunk counts as run, like claimed ids of a
+        // cancelled launch
+        failLaunch(task);
+    }
+
+    // launches nobody synced on are left to the outer sync()
+    nested_launches.resize(nested_scope);
+    nested_scope = outer_scope;
+}
+
+WorkDeque* TaskSystemParallelThreadPoolSleeping::currentDeque() {
+    return current_index >= 0 ? deques[current_index].get() : nullptr;
+}
+
+/*
+ * Runs ready work on the calling thread, one of the threads running this
+ * pool's tasks, until the launches in nested_launches from `first` on
+ * finished all their tasks. The thread waits like a worker, so it keeps
+ * picking up new work. Tasks it runs meanwhile push and pop their own
+ * launches behind the ones waited for, which may move the vector.
+ */
+void TaskSystemParallelThreadPoolSleeping::joinLaunches(size_t first) {
+    size_t last = nested_launches.size();
+    for (size_t i = first; i < last; i++) {
+        if (Task* task = findLaunch(nested_launches[i])) {
+            task->joined.store(true);
+        }
+    }
+    auto done = [&] {
+        while (first < last && isDone(nested_launches[first])) {
+            first++;
+        }
+        return first == last;
+    };
+
+    if (config.scheduler == SchedulerMode::GlobalQueue) {
+        // the oldest ready launch goes first, so a helped chunk is rarely
+        // one of ours and may join launches of its own one level further
+        // down. Past the cap only chunks of the launches waited for are
+        // run, the stack then grows no deeper than they nest
+        JoinDepthScope depth;
+        bool capped = join_depth > kMaxJoinDepth;
+        while (true) {
+            bool found = false;
+            WorkItem item;
+            waitUntil(config.worker_wait, work_event, [&] {
+                if (done()) {
+                    return true;
+                }
+                found = capped ? claimJoinedChunk(first, last, item)
+                               : num_ready.load() > 0;
+                return found;
+            });
+            if (!found) {
+                return;
+            }
+            if (capped) {
+                runGlobalItem(item);
+            } else {
+                runGlobalChunk();
+            }
+        }
+    }
+
+    int index        = current_index;
+    WorkDeque& local = *deques[index];
+    std::minstd_rand rng(index + 1);
+    while (true) {
+        WorkItem item;
+        bool found = false;
+        waitUntil(config.worker_wait, work_event, [&] {
+            if (done()) {
+                return true;
+            }
+            found = findWork(index, rng, item);
+            return found;
+        });
+        if (!found) {
+            return;
+        }
+        runItem(local, item);
+    }
+}
+
+// claims a chunk of one of the launches in nested_launches[first, last)
+bool TaskSystemParallelThreadPoolSleeping::claimJoinedChunk(size_t first,
+                                                            size_t last,
+                                                            WorkItem& item) {
+    for (size_t i = first; i < last; i++) {
+        TaskID task_id = nested_launches[i];
+        Task* task     = findLaunch(task_id);
+        if (task != nullptr && claimLaunchChunk(task, task_id, item)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskSystemParallelThreadPoolSleeping::notifyWork(bool all) {
+    bool woken = all ? work_event.notifyAll() : work_event.notifyOne();
+    // with no worker parked they may all be busy, the sizer decides
+    if (!woken) {
+        wakeSizer();
+    }
+}
+
+// lets a parked sizer look for a backlog, a fence and a load otherwise
+void TaskSystemParallelThreadPoolSleeping::wakeSizer() {
+    if (elastic() &&
+        num_workers.load(std::memory_order_relaxed) < num_threads) {
+        sizer_event.notifyOne();
+    }
+}
+
+/*
+ * Links `edge` into the successor list of `pred`. Fails with Done if `pred`
+ * is done, and with Released for an element-wise edge once `pred` was
+ * released, since task ids it already finished would never be reported.
+ * The caller counts itself in pred's num_linking.
+ */
+TaskSystemParallelThreadPoolSleeping::LinkResult
+TaskSystemParallelThreadPoolSleeping::addSuccessor(Task* pred, Edge* edge) {
+    if (edge->elementwise) {
+        // published by the CAS below, before `pred` can be released
+        pred->has_elementwise_successors.store(true,
+                                               std::memory_order_relaxed);
+    }
+    Edge* head = pred->successors.load();
+    do {
+        // like in isDone(), an open list read before the id is still ours
+        // is our launch's. The record cannot be reused after that, until
+        // the caller is done linking
+        if (head == kClosed ||
+            pred->id.load(std::memory_order_acquire) != edge->predecessor_id) {
+            return LinkResult::Done;
+        }
+        if (edge->elementwise && isReleased(head)) {
+            return LinkResult::Released;
+        }
+        edge->next = untagged(head);
+    } while (!pred->successors.compare_exchange_weak(
+        head, tagged(edge, isReleased(head)), std::memory_order_seq_cst));
+    return LinkResult::Linked;
+}
+
+/*
+ * Counts task ids [begin, end) of `task` one step closer to running, and
+ * queues the runs of ids that got there.
+ */
+void TaskSystemParallelThreadPoolSleeping::releaseIds(Task* task, int begin,
+                                                      int end,
+                                                      WorkDeque* local) {
+    int run_begin = begin;
+    for (int i = begin; i < end; i++) {
+        if (task->id_waiting[i].fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            if (run_begin < i) {
+                pushItem(WorkItem{task, run_begin, i}, local);
+            }
+            run_begin = i + 1;
+        }
+    }
+    if (run_begin < end) {
+        pushItem(WorkItem{task, run_begin, end}, local);
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::pushItem(WorkItem item,
+                                                    WorkDeque* local) {
+    int priority = item.task->priority;
+    if (local != nullptr &&
+        priority == static_cast<int>(LaunchPriority::Normal)) {
+        // the owner takes the newest item next and wakes helpers when it
+        // splits it, only the items queued behind need someone else now
+        bool surplus = !local->empty();
+        local->push(item);
+        if (surplus) {
+            notifyWork();
+        }
+        return;
+    }
+    if (!injection_inbox[priority].push(item)) {
+        std::scoped_lock<std::mutex> lck{inject_mu};
+        injection[priority].push_back(laneOf(item.task), item);
+    }
+    // like num_ready, the counts may dip below zero for a moment
+    num_injected.fetch_add(1, std::memory_order_relaxed);
+    if (priority == static_cast<int>(LaunchPriority::High)) {
+        num_injected_high.fetch_add(1, std::memory_order_relaxed);
+    }
+    notifyWork();
+}
+
+/*
+ * Moves what submitters left in ready_inbox into ready_tasks, in the lanes
+ * of their streams. Called with mu held.
+ */
+void TaskSystemParallelThreadPoolSleeping::drainReady() {
+    for (int c = 0; c < kNumLaunchPriorities; c++) {
+        Task* task;
+        while (ready_inbox[c].pop(task)) {
+            ready_tasks[c].push_back(laneOf(task), task);
+        }
+    }
+}
+
+// the same for injection_inbox, called with inject_mu held
+void TaskSystemParallelThreadPoolSleeping::drainInjected() {
+    for (int c = 0; c < kNumLaunchPriorities; c++) {
+        WorkItem item;
+        while (injection_inbox[c].pop(item)) {
+            injection[c].push_back(laneOf(item.task), item);
+        }
+    }
+}
+
+int64_t TaskSystemParallelThreadPoolSleeping::launchCost(const Task* task) {
+    if (task->type == nullptr) {
+        return task->num_total_tasks;
+    }
+    // a type never measured yet costs what tasks cost on average so far
+    auto it    = ns_per_task_by_type.find(std::type_index(*task->type));
+    int64_t ns = it != ns_per_task_by_type.end() ? it->second
+                                                 : ns_per_task_any;
+    return task->num_total_tasks * std::max<int64_t>(ns, 1);
+}
+
+/*
+ * Called with mu held once `task` is linked to its predecessors. Raises the
+ * bottom level of every unfinished launch `task` depends on, directly or
+ * not, to at least its own cost plus the bottom level below it. A walk stops
+ * at launches whose level does not change.
+ */
+void TaskSystemParallelThreadPoolSleeping::raiseBottomLevels(Task* task) {
+    level_stack.push_back(task);
+    while (!level_stack.empty()) {
+        Task* successor = level_stack.back();
+        level_stack.pop_back();
+        int64_t below = successor->bottom_level.load(std::memory_order_relaxed);
+
+        for (const Edge& edge :
+             std::span(successor->edges, successor->num_edges)) {
+            // records are only reused with mu held, so a record still
+            // holding the same launch keeps it until we are done
+            Task* pred = edge.predecessor;
+            if (pred->id.load(std::memory_order_relaxed) !=
+                    edge.predecessor_id ||
+                pred->successors.load(std::memory_order_acquire) == kClosed) {
+                continue;
+            }
+            int64_t level = pred->cost + below;
+            if (level <= pred->bottom_level.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            pred->bottom_level.store(level, std::memory_order_relaxed);
+            level_stack.push_back(pred);
+
+            // move it up in the ready heap if it is waiting there
+            if (config.scheduler == SchedulerMode::GlobalQueue) {
+                if (pred->queued) {
+                    ready_heap[pred->priority].push(pred);
+                }
+            } else {
+                std::scoped_lock<std::mutex> lck{inject_mu};
+                if (pred->queued) {
+                    ready_heap[pred->priority].push(pred);
+                }
+            }
+        }
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::releaseLaunch(Task* task,
+                                                         WorkDeque* local) {
+    if (task->num_total_tasks == 0) {
+        finishLaunch(task, local);
+        return;
+    }
+    task->ready_ns = nowNs();
+
+    if (config.scheduler == SchedulerMode::GlobalQueue) {
+        if (config.ready_order == ReadyOrder::CriticalPath ||
+            !ready_inbox[task->priority].push(task)) {
+            std::scoped_lock<std::mutex> lck{mu};
+            if (config.ready_order == ReadyOrder::CriticalPath) {
+                ready_heap[task->priority].push(task);
+            } else {
+                ready_tasks[task->priority].push_back(laneOf(task), task);
+            }
+        }
+        // counted once it can be taken, a worker may take it first and
+        // leave the count below zero for a moment
+        num_ready.fetch_add(1);
+        notifyWork(true);
+        return;
+    }
+
+    markReleased(task);
+    if (task->waits_per_id) {
+        // ids whose element-wise predecessors are done go now, the others
+        // once the predecessor gets to them
+        releaseIds(task, 0, task->num_total_tasks, local);
+        return;
+    }
+
+    // with other launches waiting, the heap decides which one goes first,
+    // with none the releasing worker just keeps going on this one. Other
+    // priority classes than Normal always go through the heaps.
+    bool normal = task->priority == static_cast<int>(LaunchPriority::Normal);
+    if (config.ready_order == ReadyOrder::CriticalPath &&
+        (!normal || local == nullptr || num_injected.load() > 0 ||
+         !local->empty())) {
+        {
+            std::scoped_lock<std::mutex> lck{inject_mu};
+            ready_heap[task->priority].push(task);
+            num_injected.fetch_add(1, std::memory_order_relaxed);
+            if (task->priority == static_cast<int>(LaunchPriority::High)) {
+                num_injected_high.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        notifyWork();
+        return;
+    }
+
+    pushItem(WorkItem{task, 0, task->num_total_tasks}, local);
+}
+
+void TaskSystemParallelThreadPoolSleeping::finishLaunch(Task* task,
+                                                        WorkDeque* local) {
+    latency_stats[task->priority].record(nowNs() - task->submit_ns);
+
+    if (task->type != nullptr && task->num_total_tasks > 0) {
+        int64_t sample = std::max<int64_t>(
+            task->busy_ns.load(std::memory_order_relaxed) /
+                task->num_total_tasks,
+            1);
+        std::scoped_lock<std::mutex> lck{mu};
+        int64_t& ns = ns_per_task_by_type[std::type_index(*task->type)];
+        ns          = ns == 0 ? sample : (3 * ns + sample) / 4;
+        ns_per_task_any =
+            ns_per_task_any == 0 ? sample : (3 * ns_per_task_any + sample) / 4;
+    }
+
+    if (task->frozen) {
+        // a cancelled launch takes its dependents with it, as below
+        bool cancelled = task->cancelled.load(std::memory_order_relaxed);
+        task->was_cancelled.store(cancelled, std::memory_order_relaxed);
+        for (Task* successor : task->frozen_successors) {
+            if (cancelled) {
+                successor->cancelled.store(true, std::memory_order_relaxed);
+            }
+            if (successor->num_waiting.fetch_sub(
+                    1, std::memory_order_acq_rel) == 1) {
+                releaseLaunch(successor, local);
+            }
+        }
+        pending_tasks.fetch_sub(task->num_total_tasks);
+        if (num_pending.fetch_sub(1) == 1) {
+            done_event.notifyAll();
+        }
+        if (limited()) {
+            room_event.notifyAll();
+        }
+        return;
+    }
+
+    // published by closing the list
+    bool cancelled = task->cancelled.load(std::memory_order_relaxed);
+    task->was_cancelled.store(cancelled, std::memory_order_relaxed);
+    Edge* edge = untagged(
+        task->successors.exchange(kClosed, std::memory_order_acq_rel));
+    while (edge != nullptr) {
+        // the successor may run and finish as soon as it is released
+        Edge* next      = edge->next;
+        Task* successor = edge->successor;
+        // for an edge linked after cancel() walked the list
+        if (cancelled) {
+            successor->cancelled.store(true, std::memory_order_relaxed);
+        }
+        // element-wise successors heard about every task id already
+        if (!edge->elementwise &&
+            successor->num_waiting.fetch_sub(1, std::memory_order_acq_rel) ==
+                1) {
+            releaseLaunch(successor, local);
+        }
+        edge = next;
+    }
+
+    // a task waiting on this launch from inside the pool parks like a
+    // worker
+    if (task->joined.load()) {
+        work_event.notifyAll();
+    }
+    // successors are released and the launch's id now reads as done, the
+    // record is free to take the next launch
+    int num_total_tasks  = task->num_total_tasks;
+    StreamState* stream = task->stream;
+    if (cancelled) {
+        std::scoped_lock<std::mutex> lck{mu};
+        (stream != nullptr ? stream->cancelled_launches : cancelled_launches)
+            .push_back(task);
+    } else {
+        launches.free(task);
+    }
+    pending_tasks.fetch_sub(num_total_tasks);
+    // the stream may be gone as soon as its count drops to zero
+    bool stream_done =
+        stream != nullptr && stream->num_pending.fetch_sub(1) == 1;
+    if (num_pending.fetch_sub(1) == 1 || stream_done) {
+        done_event.notifyAll();
+    }
+    if (limited()) {
+        room_event.notifyAll();
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable,
+                                               int num_total_tasks) {
+    //
+    // TODO: CS149 students will modify the implementation of this
+    // method in Parts A and B.  The implementation provided below runs all
+    // tasks sequentially on the calling thread.
+    //
+
+    run(runnable, num_total_tasks, LaunchOptions{});
+}
+
+void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable,
+                                               int num_total_tasks,
+                                               const LaunchOptions& options) {
+    if (current_pool == this) {
+        // from inside a task, waiting for everything pending would wait
+        // for the launch we are called from
+        size_t first   = nested_launches.size();
+        TaskID task_id = submit(runnable, num_total_tasks, {}, options,
+                                currentDeque());
+        nested_launches.push_back(task_id);
+        joinLaunches(first);
+        nested_launches.resize(first);
+        finishRun(task_id);
+        return;
+    }
+
+    // with the caller deque free, the launch goes straight into it, so a
+    // launch that is one chunk never wakes a worker
+    bool expected = false;
+    if (config.scheduler == SchedulerMode::WorkStealing &&
+        caller_busy.compare_exchange_strong(expected, true)) {
+        TaskID task_id = submit(runnable, num_total_tasks, {}, options,
+                                deques.back().get());
+        helpUntilDone();
+        caller_busy = false;
+        finishRun(task_id);
+        return;
+    }
+    TaskID task_id = runAsyncWithDeps(runnable, num_total_tasks,
+                                      std::span<const TaskID>(), options);
+    syncAll();
+    finishRun(task_id);
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(
+    IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) {
+    return runAsyncWithDeps(runnable, num_total_tasks, deps, LaunchOptions{});
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(
+    IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps,
+    const LaunchOptions& options) {
+    return runAsyncWithDeps(runnable, num_total_tasks,
+                            std::span<const TaskID>(deps), options);
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(
+    IRunnable* runnable, int num_total_tasks, std::span<const TaskID> deps,
+    const LaunchOptions& options) {
+
+    //
+    // TODO: CS149 students will implement this method in Part B.
+    //
+
+    return submitAsync(runnable, num_total_tasks, deps, options, nullptr);
+}
+
+std::optional<TaskID> TaskSystemParallelThreadPoolSleeping::tryRunAsyncWithDeps(
+    IRunnable* runnable, int num_total_tasks, std::span<const TaskID> deps,
+    const LaunchOptions& options) {
+    return trySubmitAsync(runnable, num_total_tasks, deps, options, nullptr);
+}
+
+// runAsyncWithDeps() for the pool itself or for `stream`
+TaskID TaskSystemParallelThreadPoolSleeping::submitAsync(
+    IRunnable* runnable, int num_total_tasks, std::span<const TaskID> deps,
+    const LaunchOptions& options, StreamState* stream) {
+    if (current_pool == this) {
+        // from inside a task, sync() waits for it along with the task's
+        // other launches
+        TaskID task_id = submit(runnable, num_total_tasks, deps, options,
+                                currentDeque(), false, stream);
+        nested_launches.push_back(task_id);
+        return task_id;
+    }
+    while (true) {
+        TaskID task_id = submit(runnable, num_total_tasks, deps, options,
+                                nullptr, !options.unlimited, stream);
+        if (task_id != kNoRoom) {
+            return task_id;
+        }
+        waitForRoom(num_total_tasks);
+    }
+}
+
+std::optional<TaskID> TaskSystemParallelThreadPoolSleeping::trySubmitAsync(
+    IRunnable* runnable, int num_total_tasks, std::span<const TaskID> deps,
+    const LaunchOptions& options, StreamState* stream) {
+    if (current_pool == this) {
+        return submitAsync(runnable, num_total_tasks, deps, options, stream);
+    }
+    TaskID task_id = submit(runnable, num_total_tasks, deps, options,
+                            nullptr, !options.unlimited, stream);
+    if (task_id == kNoRoom) {
+        return std::nullopt;
+    }
+    return task_id;
+}
+
+/*
+ * Whether a launch of `num_total_tasks` tasks fits under the limits on
+ * pending work right now.
+ */
+bool TaskSystemParallelThreadPoolSleeping::hasRoom(int num_total_tasks) {
+    return fits(num_pending.load(), pending_tasks.load(), num_total_tasks);
+}
+
+/*
+ * Counts a launch of `num_total_tasks` tasks as pending. If `limited` and
+ * the launch does not fit next to `launches` launches of `tasks` tasks in
+ * all, it takes the count back and returns false.
+ */
+bool TaskSystemParallelThreadPoolSleeping::reserve(int num_total_tasks,
+                                                   bool limited) {
+    int launches  = num_pending.fetch_add(1);
+    int64_t tasks = pending_tasks.fetch_add(num_total_tasks);
+    if (!limited || fits(launches, tasks, num_total_tasks)) {
+        return true;
+    }
+    // submitters and sync() may have seen the count meanwhile
+    pending_tasks.fetch_sub(num_total_tasks);
+    if (num_pending.fetch_sub(1) == 1) {
+        done_event.notifyAll();
+    }
+    room_event.notifyAll();
+    return false;
+}
+
+bool TaskSystemParallelThreadPoolSleeping::fits(int launches, int64_t tasks,
+                                                int num_total_tasks) const {
+    if (launches == 0) {
+        return true;
+    }
+    if (config.max_pending_launches > 0 &&
+        launches >= config.max_pending_launches) {
+        return false;
+    }
+    return config.max_pending_tasks <= 0 ||
+           tasks + num_total_tasks <= config.max_pending_tasks;
+}
+
+/*
+ * Holds a submitter back until a launch of `num_total_tasks` tasks fits.
+ * Like sync(), it works on ready tasks meanwhile if it may.
+ */
+void TaskSystemParallelThreadPoolSleeping::waitForRoom(int num_total_tasks) {
+    helpOrWait(room_event,
+               [this, num_total_tasks] { return hasRoom(num_total_tasks); });
+}
+
+/*
+ * Returns kNoRoom without launching if `limited` and the launch does not
+ * fit under the limits on pending work.
+ */
+TaskID TaskSystemParallelThreadPoolSleeping::submit(
+    IRunnable* runnable, int num_total_tasks, std::span<const TaskID> deps,
+    const LaunchOptions& options, WorkDeque* local, bool limited,
+    StreamState* stream) {
+    // submitters only take mu for the critical path order, which ranks
+    // the records of other launches while it links this one
+    bool by_level = config.ready_order == ReadyOrder::CriticalPath;
+    TaskID task_id;
+    Task* task;
+    {
+        std::unique_lock<std::mutex> lck{mu, std::defer_lock};
+        if (by_level) {
+            lck.lock();
+        }
+        if (!reserve(num_total_tasks, limited)) {
+            return kNoRoom;
+        }
+        task = launches.alloc([&task_id](Task* task) {
+            task_id = nextTaskID(task->id.load(std::memory_order_relaxed),
+                                 task->slot);
+            // the new id goes first, whoever reads the successor list of
+            // the record below knows from the id whose list it read
+            task->id.store(task_id, std::memory_order_release);
+            task->successors.store(nullptr, std::memory_order_release);
+        });
+        task->seq             = by_level ? next_seq++ : 0;
+        task->runnable        = runnable;
+        task->range           = task->adapter.bind(runnable);
+        task->num_total_tasks = num_total_tasks;
+        task->grain_size      = options.grain_size;
+        task->num_started     = 0;
+        task->ns_per_task     = 0;
+        task->num_finished    = 0;
+        task->num_waiting     = 1;
+        task->waits_per_id    = false;
+        task->busy_ns         = 0;
+        task->type            = nullptr;
+        task->frozen          = false;
+        task->joined          = false;
+        task->priority        = static_cast<int>(options.priority);
+        task->stream          = stream;
+        task->submit_ns       = nowNs();
+        task->started         = false;
+        task->cancelled       = false;
+        task->error_reported  = false;
+        task->has_elementwise_successors = false;
+        if (by_level && config.cost_model == CostModel::Measured) {
+            task->type = &typeid(*runnable);
+        }
+        task->cost         = by_level ? launchCost(task) : 0;
+        task->bottom_level = task->cost;
+        if (stream != nullptr) {
+            stream->num_pending++;
+        }
+
+        // element-wise edges need the same task count on both ends, and a
+        // worker that finishes task ids to tell them to, GlobalQueue mode
+        // waits for every dependency in full
+        bool elementwise =
+            options.dependency == DependencyKind::ElementWise &&
+            config.scheduler == SchedulerMode::WorkStealing &&
+            num_total_tasks > 0;
+        // at most this many, the task counts are compared below once the
+        // predecessor's record cannot be reused under us
+        int num_candidates = 0;
+        for (TaskID dep : deps) {
+            if (elementwise && findLaunch(dep) != nullptr) {
+                num_candidates++;
+            }
+        }
+        if (num_candidates > 0) {
+            // count every candidate up front, the predecessor may finish
+            // task ids right after its edge is linked in. Counts no edge
+            // ends up using are dropped once all edges are linked
+            if (task->id_waiting_capacity < num_total_tasks) {
+                task->id_waiting =
+                    std::make_unique<std::atomic_int[]>(num_total_tasks);
+                task->id_waiting_capacity = num_total_tasks;
+            }
+            task->waits_per_id = true;
+            for (int i = 0; i < num_total_tasks; i++) {
+                task->id_waiting[i].store(1 + num_candidates,
+                                          std::memory_order_relaxed);
+            }
+        }
+        // dependencies that are done get no edge, so this may be more
+        // than needed
+        if (deps.size() <= Task::kInlineEdges) {
+            task->edges = task->inline_edges;
+        } else {
+            if (task->spilled_edges.size() < deps.size()) {
+                task->spilled_edges.resize(deps.size());
+            }
+            task->edges = task->spilled_edges.data();
+        }
+        int num_edges       = 0;
+        int num_elementwise = 0;
+        for (TaskID dep : deps) {
+            // a dep whose record was reused is long done
+            Task* pred = findLaunch(dep);
+            if (pred == nullptr) {
+                continue;
+            }
+            Edge* edge           = &task->edges[num_edges];
+            edge->predecessor    = pred;
+            edge->predecessor_id = dep;
+            edge->successor      = task;
+            // counted in num_linking with the id still ours, the record is
+            // not reused before we are done with it
+            pred->num_linking.fetch_add(1);
+            edge->elementwise =
+                num_candidates > 0 &&
+                pred->id.load(std::memory_order_acquire) == dep &&
+                pred->num_total_tasks == num_total_tasks;
+            // count the edge first, the predecessor may finish right after
+            // the edge is linked in
+            if (!edge->elementwise) {
+                task->num_waiting.fetch_add(1, std::memory_order_relaxed);
+            }
+            LinkResult result = addSuccessor(pred, edge);
+            if (result == LinkResult::Released) {
+                // too late to hear about each task id, wait for all of them
+                edge->elementwise = false;
+                task->num_waiting.fetch_add(1, std::memory_order_relaxed);
+                result = addSuccessor(pred, edge);
+            }
+            // read once linked: a cancel() of `pred` from here on reaches
+            // the edge, or pred's finishLaunch() passes the flag on. The
+            // record of a cancelled launch is not reused before sync(), one
+            // that went to another launch held one that was not cancelled
+            bool pred_cancelled = result == LinkResult::Done
+                                      ? pred->was_cancelled.load()
+                                      : pred->cancelled.load();
+            if (pred_cancelled && pred->id.load() == dep) {
+                task->cancelled = true;
+            }
+            pred->num_linking.fetch_sub(1);
+            if (result == LinkResult::Linked) {
+                num_edges++;
+                num_elementwise += edge->elementwise;
+            } else if (!edge->elementwise) {
+                task->num_waiting.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        if (num_elementwise == 0) {
+            // nobody links to the counters, release the launch as a whole
+            task->waits_per_id = false;
+        } else if (num_elementwise < num_candidates) {
+            // candidates that turned out done, gone or of another size
+            int unused = num_candidates - num_elementwise;
+            for (int i = 0; i < num_total_tasks; i++) {
+                task->id_waiting[i].fetch_sub(unused,
+                                              std::memory_order_relaxed);
+            }
+        }
+        task->num_edges = num_edges;
+
+        if (by_level) {
+            raiseBottomLevels(task);
+        }
+    }
+
+    // from here on the launch may finish and its record be reused at any
+    // moment
+    if (task->num_waiting.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        releaseLaunch(task, local);
+    }
+    return task_id;
+}
+
+std::unique_ptr<GraphReplay> TaskSystemParallelThreadPoolSleeping::buildReplay(
+    const TaskGraph& graph) {
+    auto replay   = std::make_unique<GraphReplay>();
+    replay->nodes = std::make_unique<Task[]>(graph.size());
+    replay->busy  = false;
+    replay->graph = graph.lifetime();
+
+    // nodes only depend on earlier ones, so walking backwards sees every
+    // successor's bottom level before the node's own
+    for (int i = graph.size() - 1; i >= 0; i--) {
+        const TaskGraph::Node& node = graph.node(i);
+        Task* task            = &replay->nodes[i];
+        task->id              = i;
+        task->seq             = i;
+        task->runnable        = node.runnable;
+        task->range           = task->adapter.bind(node.runnable);
+        task->num_total_tasks = node.num_total_tasks;
+        task->grain_size      = node.options.grain_size;
+        task->successors      = kClosed;
+        task->type            = nullptr;
+        task->frozen          = true;
+        task->cancelled       = false;
+        task->priority        = static_cast<int>(node.options.priority);
+        task->stream          = nullptr;
+        task->cost            = node.num_total_tasks;
+
+        int64_t below = 0;
+        for (int successor : graph.successors(i)) {
+            Task* next = &replay->nodes[successor];
+            task->frozen_successors.push_back(next);
+            below = std::max(below, next->bottom_level.load());
+        }
+        task->bottom_level = task->cost + below;
+    }
+    return replay;
+}
+
+void TaskSystemParallelThreadPoolSleeping::runGraph(const TaskGraph& graph) {
+    // the records would be waited for with everything else pending. A
+    // graph that was never built has nothing to keep its replay alive by
+    if (current_pool == this || graph.lifetime().expired()) {
+        ITaskSystem::runGraph(graph);
+        return;
+    }
+
+    GraphReplay* replay;
+    {
+        std::scoped_lock<std::mutex> lck{mu};
+        auto it = replays.find(graph.id());
+        if (it == replays.end()) {
+            // nobody can be replaying a graph that is gone, its caller
+            // would still hold it
+            std::erase_if(replays, [](const auto& entry) {
+                return entry.second->graph.expired();
+            });
+            it = replays.emplace(graph.id(), buildReplay(graph)).first;
+        }
+        replay = it->second.get();
+    }
+
+    bool expected = false;
+    if (!replay->busy.compare_exchange_strong(expected, true)) {
+        // another thread is replaying the same graph, its records are taken
+        ITaskSystem::runGraph(graph);
+        return;
+    }
+
+    // nothing from the last replay touches the records any more, its
+    // runGraph() returned after every launch was done
+    int num_nodes     = graph.size();
+    int64_t num_tasks = 0;
+    int64_t now       = nowNs();
+    for (int i = 0; i < num_nodes; i++) {
+        Task* task         = &replay->nodes[i];
+        task->num_started  = 0;
+        task->num_finished = 0;
+        task->ns_per_task  = 0;
+        task->num_waiting  = graph.inDegree(i);
+        task->queued       = false;
+        task->submit_ns    = now;
+        task->started      = false;
+        task->cancelled    = false;
+        num_tasks += task->num_total_tasks;
+    }
+    pending_tasks.fetch_add(num_tasks);
+    num_pending.fetch_add(num_nodes);
+
+    expected      = false;
+    bool own_deque = config.scheduler == SchedulerMode::WorkStealing &&
+                     caller_busy.compare_exchange_strong(expected, true);
+    WorkDeque* local = own_deque ? deques.back().get() : nullptr;
+    for (int i = 0; i < num_nodes; i++) {
+        if (graph.inDegree(i) == 0) {
+            releaseLaunch(&replay->nodes[i], local);
+        }
+    }
+
+    if (own_deque) {
+        helpUntilDone();
+        caller_busy = false;
+    } else {
+        syncAll();
+    }
+
+    // the first exception in node order, the records keep none of them
+    std::exception_ptr error;
+    for (int i = 0; i < num_nodes; i++) {
+        std::exception_ptr node_error =
+            std::exchange(replay->nodes[i].error, nullptr);
+        if (!error) {
+            error = node_error;
+        }
+    }
+    replay->busy = false;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+PriorityStats TaskSystemParallelThreadPoolSleeping::priorityStats(
+    LaunchPriority priority) const {
+    int c = static_cast<int>(priority);
+    return PriorityStats{wait_stats[c].snapshot(), latency_stats[c].snapshot()};
+}
+
+void TaskSystemParallelThreadPoolSleeping::resetPriorityStats() {
+    for (int c = 0; c < kNumLaunchPriorities; c++) {
+        wait_stats[c].reset();
+        latency_stats[c].reset();
+    }
+}
+
+PoolSizeStats TaskSystemParallelThreadPoolSleeping::poolSizeStats() {
+    std::scoped_lock<std::mutex> lck{size_mu};
+    return size_stats;
+}
+
+void TaskSystemParallelThreadPoolSleeping::resetPoolSizeStats() {
+    std::scoped_lock<std::mutex> lck{size_mu};
+    size_stats    = PoolSizeStats{};
+    size_start_ns = nowNs();
+    recordPoolSize(size_start_ns);
+}
+
+void TaskSystemParallelThreadPoolSleeping::sync() {
+
+    //
+    // TODO: CS149 students will modify the implementation of this method in Part B.
+    //
+
+    if (current_pool == this) {
+        syncNested();
+        return;
+    }
+    syncAll();
+    if (std::exception_ptr error = dropCancelled(cancelled_launches, nullptr)) {
+        std::rethrow_exception(error);
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::sync(
+    std::vector<TaskID>& cancelled) {
+    cancelled.clear();
+    if (current_pool == this) {
+        syncNested();
+        return;
+    }
+    syncAll();
+    if (std::exception_ptr error =
+            dropCancelled(cancelled_launches, &cancelled)) {
+        std::rethrow_exception(error);
+    }
+}
+
+/*
+ * sync() from a task: waits for the launches the task made and rethrows
+ * the first exception one of them had. Their records are left to the
+ * outer sync().
+ */
+void TaskSystemParallelThreadPoolSleeping::syncNested() {
+    joinLaunches(nested_scope);
+    std::exception_ptr error;
+    for (size_t i = nested_scope; i < nested_launches.size() && !error; i++) {
+        error = takeError(nested_launches[i]);
+    }
+    nested_launches.resize(nested_scope);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/*
+ * Hands the records of the cancelled `launches` back for reuse, once their
+ * ids were reported to `ids` if it is set. Returns the first exception
+ * that neither wait() nor run() rethrew.
+ */
+std::exception_ptr TaskSystemParallelThreadPoolSleeping::dropCancelled(
+    std::vector<Task*>& launches, std::vector<TaskID>* ids) {
+    std::exception_ptr error;
+    std::scoped_lock<std::mutex> lck{mu};
+    for (Task* task : launches) {
+        if (ids != nullptr) {
+            ids->push_back(task->id.load(std::memory_order_relaxed));
+        }
+        if (!error && !task->error_reported) {
+            error = task->error;
+        }
+        task->error = nullptr;
+        this->launches.free(task);
+    }
+    launches.clear();
+    return error;
+}
+
+/*
+ * sync() from outside the pool, without reporting cancelled launches or
+ * exceptions. run() and runGraph() leave them to the next sync().
+ */
+void TaskSystemParallelThreadPoolSleeping::syncAll() {
+    helpOrWait(done_event, [this] { return num_pending.load() == 0; });
+}
+
+/*
+ * The record of launch `task_id`, or nullptr if the launch is done and its
+ * record went to another launch. Without mu held, that may happen right
+ * after this returns.
+ */
+Task* TaskSystemParallelThreadPoolSleeping::findLaunch(TaskID task_id) {
+    if (task_id < 0) {
+        return nullptr;
+    }
+    Task* task = launches.find(static_cast<uint32_t>(task_id));
+    if (task == nullptr ||
+        task->id.load(std::memory_order_acquire) != task_id) {
+        return nullptr;
+    }
+    return task;
+}
+
+bool TaskSystemParallelThreadPoolSleeping::isDone(TaskID task_id) {
+    Task* task = findLaunch(task_id);
+    if (task == nullptr) {
+        return true;
+    }
+    // reuse changes the id before it reopens the list, an open list read
+    // before the id is still ours belongs to our launch
+    bool finished = isFinished(task);
+    return finished || task->id.load(std::memory_order_acquire) != task_id;
+}
+
+LaunchStatus TaskSystemParallelThreadPoolSleeping::wait(TaskID task_id) {
+    if (isDone(task_id)) {
+        return statusOf(task_id);
+    }
+
+    // the thread helps if it may, like in sync(), but only until this
+    // launch is done
+    bool expected = false;
+    if (current_pool == this) {
+        size_t first = nested_launches.size();
+        nested_launches.push_back(task_id);
+        joinLaunches(first);
+        nested_launches.resize(first);
+    } else if (caller_busy.compare_exchange_strong(expected, true)) {
+        {
+            PoolScope scope(this,
+                            config.scheduler == SchedulerMode::WorkStealing
+                                ? num_threads
+                                : -1);
+            ContextScope context(contexts[num_threads]);
+            size_t first = nested_launches.size();
+            nested_launches.push_back(task_id);
+            joinLaunches(first);
+            nested_launches.resize(first);
+        }
+        caller_busy = false;
+    } else {
+        if (Task* task = findLaunch(task_id)) {
+            task->joined.store(true);
+        }
+        waitUntil(config.caller_wait, work_event,
+                  [this, task_id] { return isDone(task_id); });
+    }
+    return statusOf(task_id);
+}
+
+// for a launch that is done, rethrows what one of its tasks threw
+LaunchStatus TaskSystemParallelThreadPoolSleeping::statusOf(TaskID task_id) {
+    Task* task = findLaunch(task_id);
+    if (task == nullptr) {
+        return LaunchStatus::Done;
+    }
+    bool cancelled = task->was_cancelled.load(std::memory_order_acquire);
+    // the record may have gone to another launch after the flag was read
+    if (!cancelled || task->id.load(std::memory_order_acquire) != task_id) {
+        return LaunchStatus::Done;
+    }
+    if (std::exception_ptr error = takeError(task_id)) {
+        std::rethrow_exception(error);
+    }
+    return LaunchStatus::Cancelled;
+}
+
+/*
+ * Ends a run() of launch `task_id`, which is done: rethrows what one of
+ * its tasks threw. Nobody else knows the id, so unlike other cancelled
+ * launches its record goes back for reuse right away rather than with the
+ * next outside sync(). From inside a task the record may not be listed
+ * yet, it is then left to that sync().
+ */
+void TaskSystemParallelThreadPoolSleeping::finishRun(TaskID task_id) {
+    std::exception_ptr error;
+    {
+        std::scoped_lock<std::mutex> lck{mu};
+        Task* task = findLaunch(task_id);
+        auto it    = std::find(cancelled_launches.begin(),
+                               cancelled_launches.end(), task);
+        if (task == nullptr || it == cancelled_launches.end()) {
+            return;
+        }
+        cancelled_launches.erase(it);
+        error       = task->error;
+        task->error = nullptr;
+        launches.free(task);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/*
+ * The exception a task of the done launch `task_id` threw, if any, which
+ * sync() then leaves alone.
+ */
+std::exception_ptr TaskSystemParallelThreadPoolSleeping::takeError(
+    TaskID task_id) {
+    Task* task = findLaunch(task_id);
+    if (task == nullptr ||
+        !task->was_cancelled.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    // a failed launch is a cancelled one, its record is only freed by an
+    // outside sync() with mu held
+    std::scoped_lock<std::mutex> lck{mu};
+    if (task->id.load(std::memory_order_relaxed) != task_id || !task->error) {
+        return nullptr;
+    }
+    task->error_reported = true;
+    return task->error;
+}
+
+bool TaskSystemParallelThreadPoolSleeping::cancel(TaskID task_id) {
+    std::scoped_lock<std::mutex> lck{mu};
+    launches.hold();
+    Task* root = findLaunch(task_id);
+    // as in isDone(), an open list only belongs to our launch if the id
+    // still reads as ours after it: alloc() checks the hold before it
+    // hands the record to another launch, not in the same step
+    bool found = root != nullptr && !isFinished(root) &&
+                 root->id.load(std::memory_order_acquire) == task_id;
+    if (found) {
+        cancelFrom(root);
+    }
+    launches.release();
+    return found;
+}
+
+/*
+ * Cancels `root`, which is not done, and every launch that depends on it.
+ * Called with mu held and the records on hold, so no record is reused and
+ * every successor list read below stays linked to records that hold the
+ * same launches.
+ */
+void TaskSystemParallelThreadPoolSleeping::cancelFrom(Task* root) {
+    std::vector<Task*> stack{root};
+    while (!stack.empty()) {
+        Task* task = stack.back();
+        stack.pop_back();
+        if (task->frozen) {
+            // replayed graph launches keep their successor list closed
+            if (!task->cancelled.exchange(true)) {
+                stack.insert(stack.end(), task->frozen_successors.begin(),
+                             task->frozen_successors.end());
+            }
+            continue;
+        }
+        Edge* head = task->successors.load(std::memory_order_acquire);
+        if (head == kClosed || task->cancelled.exchange(true)) {
+            continue;
+        }
+        for (Edge* edge = untagged(head); edge != nullptr; edge = edge->next) {
+            stack.push_back(edge->successor);
+        }
+    }
+}
+
+/*
+ * Called from the catch block around tasks of `task`. Keeps the first
+ * exception and cancels the launch, so its unclaimed task ids and its
+ * dependents are skipped.
+ */
+void TaskSystemParallelThreadPoolSleeping::failLaunch(Task* task) {
+    std::scoped_lock<std::mutex> lck{mu};
+    if (!task->error) {
+        task->error = std::current_exception();
+    }
+    launches.hold();
+    cancelFrom(task);
+    launches.release();
+}
+
+template <typename Pred>
+void TaskSystemParallelThreadPoolSleeping::helpUntil(EventCount& event,
+                                                     Pred&& done) {
+    PoolScope scope(this, config.scheduler == SchedulerMode::WorkStealing
+                              ? num_threads
+                              : -1);
+    ContextScope context(contexts[num_threads]);
+
+    // the caller works on ready tasks as long as it finds some, once it has
+    // to park it only waits for `event` and leaves new work to workers
+    if (config.scheduler == SchedulerMode::GlobalQueue) {
+        while (true) {
+            bool found = false;
+            waitUntil(config.caller_wait, event, [&] {
+                if (done()) {
+                    return true;
+                }
+                found = num_ready.load() > 0;
+                return found;
+            });
+            if (!found) {
+                return;
+            }
+            runGlobalChunk();
+        }
+    }
+
+    int index        = num_threads;
+    WorkDeque& local = *deques[index];
+    std::minstd_rand rng(index + 1);
+    while (true) {
+        WorkItem item;
+        bool found = false;
+        waitUntil(config.caller_wait, event, [&] {
+            if (done()) {
+                return true;
+            }
+            found = findWork(index, rng, item);
+            return found;
+        });
+        if (!found) {
+            return;
+        }
+        runItem(local, item);
+    }
+}
+
+/*
+ * Waits until `done()` holds, from outside the pool. Only one outside
+ * thread at a time can own the caller deque and worker context and help
+ * like in helpUntil(), any other one just waits.
+ */
+template <typename Pred>
+void TaskSystemParallelThreadPoolSleeping::helpOrWait(EventCount& event,
+                                                      Pred&& done) {
+    bool expected = false;
+    if (caller_busy.compare_exchange_strong(expected, true)) {
+        helpUntil(event, done);
+        caller_busy = false;
+        return;
+    }
+    waitUntil(config.caller_wait, event, done);
+}
+
+void TaskSystemParallelThreadPoolSleeping::helpUntilDone() {
+    helpUntil(done_event, [this] { return num_pending.load() == 0; });
+}
+
+std::unique_ptr<ITaskSystem> TaskSystemParallelThreadPoolSleeping::createStream() {
+    return std::make_unique<TaskStream>(this);
+}
+
+bool TaskSystemParallelThreadPoolSleeping::supportsConcurrentSubmit() {
+    return true;
+}
+
+int TaskSystemParallelThreadPoolSleeping::numWorkerContexts() {
+    return contexts.size();
+}
+
+int TaskSystemParallelThreadPoolSleeping::openLane() {
+    std::scoped_lock<std::mutex> lck{mu};
+    if (free_lanes.empty()) {
+        return num_lanes++;
+    }
+    int lane = free_lanes.back();
+    free_lanes.pop_back();
+    return lane;
+}
+
+// once the stream's launches are done, nothing is queued in its lane
+void TaskSystemParallelThreadPoolSleeping::closeLane(int lane) {
+    std::scoped_lock<std::mutex> lck{mu};
+    free_lanes.push_back(lane);
+}
+
+/*
+ * ================================================================
+ * Task stream implementation
+ * ================================================================
+ */
+
+TaskStream::TaskStream(TaskSystemParallelThreadPoolSleeping* pool)
+    : ITaskSystem(pool->num_threads), pool(pool), first_id(0) {
+    state.lane = pool->openLane();
+}
+
+TaskStream::~TaskStream() {
+    // the pool's records point at `state` until their launches are done,
+    // an exception nobody synced for is dropped
+    try {
+        sync();
+    } catch (...) {
+    }
+    pool->closeLane(state.lane);
+}
+
+const char* TaskStream::name() {
+    return "Task Stream";
+}
+
+void TaskStream::run(IRunnable* runnable, int num_total_tasks) {
+    run(runnable, num_total_tasks, LaunchOptions{});
+}
+
+void TaskStream::run(IRunnable* runnable, int num_total_tasks,
+                     const LaunchOptions& options) {
+    // no stream id, nothing can name the launch
+    pool->wait(pool->submitAsync(runnable, num_total_tasks, {}, options,
+                                 &state));
+}
+
+TaskID TaskStream::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                    const std::vector<TaskID>& deps) {
+    return runAsyncWithDeps(runnable, num_total_tasks, deps, LaunchOptions{});
+}
+
+TaskID TaskStream::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                    const std::vector<TaskID>& deps,
+                                    const LaunchOptions& options) {
+    return runAsyncWithDeps(runnable, num_total_tasks,
+                            std::span<const TaskID>(deps), options);
+}
+
+TaskID TaskStream::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                    std::span<const TaskID> deps,
+                                    const LaunchOptions& options) {
+    pool_ids.push_back(pool->submitAsync(runnable, num_total_tasks,
+                                         poolDeps(deps), options, &state));
+    return first_id + pool_ids.size() - 1;
+}
+
+std::optional<TaskID> TaskStream::tryRunAsyncWithDeps(
+    IRunnable* runnable, int num_total_tasks, std::span<const TaskID> deps,
+    const LaunchOptions& options) {
+    std::optional<TaskID> pool_id = pool->trySubmitAsync(
+        runnable, num_total_tasks, poolDeps(deps), options, &state);
+    if (!pool_id) {
+        return std::nullopt;
+    }
+    pool_ids.push_back(*pool_id);
+    return first_id + pool_ids.size() - 1;
+}
+
+void TaskStream::sync() {
+    if (std::exception_ptr error = syncLaunches(nullptr)) {
+        std::rethrow_exception(error);
+    }
+}
+
+void TaskStream::sync(std::vector<TaskID>& cancelled) {
+    cancelled.clear();
+    if (std::exception_ptr error = syncLaunches(&cancelled)) {
+        std::rethrow_exception(error);
+    }
+}
+
+LaunchStatus TaskStream::wait(TaskID task_id) {
+    TaskID pool_id = poolId(task_id);
+    return pool_id < 0 ? LaunchStatus::Done : pool->wait(pool_id);
+}
+
+bool TaskStream::isDone(TaskID task_id) {
+    TaskID pool_id = poolId(task_id);
+    return pool_id < 0 || pool->isDone(pool_id);
+}
+
+bool TaskStream::cancel(TaskID task_id) {
+    TaskID pool_id = poolId(task_id);
+    return pool_id >= 0 && pool->cancel(pool_id);
+}
+
+int TaskStream::numWorkerContexts() {
+    return pool->numWorkerContexts();
+}
+
+// the pool's id of launch `task_id`, or -1 if it is not a launch since the
+// last sync()
+TaskID TaskStream::poolId(TaskID task_id) const {
+    if (task_id < first_id ||
+        task_id - first_id >= static_cast<TaskID>(pool_ids.size())) {
+        return -1;
+    }
+    return pool_ids[task_id - first_id];
+}
+
+// `deps` as pool ids, the ones done for sure are left out
+std::span<const TaskID> TaskStream::poolDeps(std::span<const TaskID> deps) {
+    dep_ids.clear();
+    for (TaskID dep : deps) {
+        if (TaskID pool_id = poolId(dep); pool_id >= 0) {
+            dep_ids.push_back(pool_id);
+        }
+    }
+    return dep_ids;
+}
+
+/*
+ * Waits for the stream's launches and drops its cancelled ones, reporting
+ * their stream ids to `cancelled` if it is set. Returns the first exception
+ * nobody rethrew yet. From inside a task, it waits like the pool's sync()
+ * for what that task launched.
+ */
+std::exception_ptr TaskStream::syncLaunches(std::vector<TaskID>* cancelled) {
+    if (current_pool == pool) {
+        pool->syncNested();
+        return nullptr;
+    }
+    pool->helpOrWait(pool->done_event,
+                     [this] { return state.num_pending.load() == 0; });
+
+    std::vector<TaskID> dropped;
+    std::exception_ptr error = pool->dropCancelled(
+        state.cancelled_launches, cancelled != nullptr ? &dropped : nullptr);
+    if (!dropped.empty()) {
+        // launches of run() have no stream id and are not reported
+        std::unordered_map<TaskID, TaskID> stream_ids;
+        for (size_t i = 0; i < pool_ids.size(); i++) {
+            stream_ids[pool_ids[i]] = first_id + i;
+        }
+        for (TaskID pool_id : dropped) {
+            if (auto it = stream_ids.find(pool_id); it != stream_ids.end()) {
+                cancelled->push_back(it->second);
+            }
+        }
+    }
+    first_id += pool_ids.size();
+    pool_ids.clear();
+    return error;
 }
@@ -3,14 +3,48 @@
 #define _TASKSYS_H
 
 #include "itasksys.h"
+#include "park.h"
+#include "topology.h"
+#include "wsdeque.h"
+#include <array>
 #include <atomic>
-#include <condition_variable>
+#include <bit>
+#include <cstddef>
 #include <deque>
+#include <condition_variable>
+#include <exception>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <random>
 #include <thread>
+#include <typeindex>
+#include <unordered_map>
 #include <vector>
 
+/*
+ * WorkerContexts: the WorkerContext of each thread a task system runs
+ * tasks on, by worker index. Each one starts on a cache line of its own,
+ * workers touching their own context never share a line.
+ */
+class WorkerContexts {
+    public:
+        explicit WorkerContexts(int count) : slots(count) {
+            for (int i = 0; i < count; i++) {
+                slots[i].context.worker_index = i;
+            }
+        }
+
+        int size() const { return slots.size(); }
+        WorkerContext* operator[](int index) { return &slots[index].context; }
+
+    private:
+        struct alignas(64) Slot {
+            WorkerContext context;
+        };
+        std::vector<Slot> slots;
+};
+
 /*
  * TaskSystemSerial: This class is the student's implementation of a
  * serial task execution engine.  See definition of ITaskSystem in
@@ -22,9 +56,14 @@ class TaskSystemSerial: public ITaskSystem {
         ~TaskSystemSerial();
         const char* name();
         void run(IRunnable* runnable, int num_total_tasks);
+        using ITaskSystem::runAsyncWithDeps;
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
+        using ITaskSystem::sync;
         void sync();
+        int numWorkerContexts();
+    private:
+        WorkerContexts contexts;
 };
 
 /*
@@ -39,13 +78,175 @@ class TaskSystemParallelSpawn: public ITaskSystem {
         ~TaskSystemParallelSpawn();
         const char* name();
         void run(IRunnable* runnable, int num_total_tasks);
+        using ITaskSystem::runAsyncWithDeps;
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
+        using ITaskSystem::sync;
         void sync();
+        int numWorkerContexts();
     private:
         int num_threads;
+        WorkerContexts contexts;  // by spawned thread
+};
+
+/*
+ * SchedulerMode: how ready launches are handed out to the workers of
+ * TaskSystemParallelThreadPoolSleeping.
+ *
+ *  - GlobalQueue: one shared `ready_tasks` queue, every worker claims a
+ *    task id under `mu`.
+ *  - WorkStealing: every worker owns a Chase-Lev deque of task id ranges
+ *    and steals from a random victim when it runs dry. New launches from
+ *    runAsyncWithDeps() go to a global injection queue, launches released
+ *    by a finishing task go to the deque of the worker that released them.
+ *    High and Low priority launches always go to the injection queue of
+ *    their class, workers look for High ones before their own deque.
+ */
+enum class SchedulerMode {
+    GlobalQueue,
+    WorkStealing,
+};
+
+/*
+ * GrainPolicy: how many task ids a worker claims at once, unless the launch
+ * asks for a fixed LaunchOptions::grain_size.
+ *
+ *  - Fixed: always `grain_size` ids.
+ *  - Guided: a share of the ids the launch has left, so chunks shrink as
+ *    the launch runs out of work. Never below `grain_size`.
+ *  - Adaptive: enough ids to keep a worker busy for `target_chunk_us`,
+ *    going by the per-task time measured on earlier chunks of the launch.
+ */
+enum class GrainPolicy {
+    Fixed,
+    Guided,
+    Adaptive,
+};
+
+/*
+ * ReadyOrder: which ready launch TaskSystemParallelThreadPoolSleeping starts
+ * first when several are ready.
+ *
+ *  - Fifo: the one that became ready first.
+ *  - CriticalPath: the one with the highest bottom level, i.e. the longest
+ *    chain of work that still depends on it, counting its own cost. Bottom
+ *    levels are raised as successors get submitted.
+ */
+enum class ReadyOrder {
+    Fifo,
+    CriticalPath,
+};
+
+/*
+ * CostModel: the cost of a launch for ReadyOrder::CriticalPath.
+ *
+ *  - Tasks: its num_total_tasks.
+ *  - Measured: its num_total_tasks times the time per task measured on
+ *    earlier launches of the same IRunnable type.
+ */
+enum class CostModel {
+    Tasks,
+    Measured,
+};
+
+struct PoolConfig {
+    SchedulerMode scheduler = SchedulerMode::WorkStealing;
+
+    ReadyOrder ready_order = ReadyOrder::Fifo;
+    CostModel cost_model   = CostModel::Tasks;
+
+    GrainPolicy grain_policy = GrainPolicy::Guided;
+    int grain_size           = 1;
+    int target_chunk_us      = 20;
+
+    // where workers run
+    Affinity affinity;
+
+    // how idle workers wait for work
+    WaitStrategy worker_wait;
+    // how the thread in run() / sync() waits for its launches
+    WaitStrategy caller_wait;
+
+    /*
+     * Limits on launches not done yet and on their total task count, 0 for
+     * none. A runAsyncWithDeps() from outside the pool that would go over
+     * waits until enough launches are done. Launches made from inside
+     * tasks are never held back, the pending ones may be waiting for
+     * them, and neither are launches with LaunchOptions::unlimited. A
+     * launch with more tasks than the limit goes when nothing else is
+     * pending.
+     */
+    int max_pending_launches  = 0;
+    int64_t max_pending_tasks = 0;
+
+    /*
+     * A priority class with ready work is served at the latest after
+     * higher classes went ahead of it for this long, 0 never lets it
+     * ahead. See PriorityPicker.
+     */
+    int priority_aging_us = 10000;
+
+    /*
+     * Elastic sizing of TaskSystemParallelThreadPoolSleeping, off while
+     * min_workers is negative. The pool starts with min_workers workers
+     * and grows up to the thread count it was made with. A worker is
+     * added once ready work waited on every check for grow_after_us, so
+     * nobody was free to take it, then one more per grow_after_us while
+     * that lasts. A worker that found no work for retire_after_ms exits,
+     * down to min_workers. Pauses in a burst shorter than that keep the
+     * workers around.
+     */
+    int min_workers     = -1;
+    int grow_after_us   = 1000;
+    int retire_after_ms = 100;
+
+    /*
+     * reads TASKSYS_SCHEDULER=global|steal,
+     * TASKSYS_ORDER=fifo|cpath[:tasks|measured],
+     * TASKSYS_GRAIN=fixed[:N]|guided[:N]|adaptive[:US] and
+     * TASKSYS_WAIT=SPIN_US:YIELD_US (applies to workers and callers) and
+     * TASKSYS_AFFINITY=none|compact|scatter|CPU_LIST and
+     * TASKSYS_MAX_PENDING=LAUNCHES[:TASKS] and
+     * TASKSYS_PRIORITY_AGING=US and
+     * TASKSYS_ELASTIC=MIN_WORKERS[:GROW_US[:RETIRE_MS]]
+     */
+    static PoolConfig fromEnv();
 };
 
+/*
+ * Number of task ids to claim next from a launch with `remaining` unclaimed
+ * ids. `ns_per_task` is the measured cost of one task, or 0 if unknown.
+ */
+int chunkSize(const PoolConfig& config, int launch_grain, int remaining,
+              int num_workers, int64_t ns_per_task);
+
+/*
+ * RangeAdapter: lets the pools run every launch through runRange(). It
+ * runs a plain IRunnable's tasks one runTask() at a time, an
+ * IRangeRunnable is used as is. Launch records embed one, so telling the
+ * two apart costs a single dynamic_cast per launch.
+ */
+class RangeAdapter: public IRangeRunnable {
+    public:
+        IRangeRunnable* bind(IRunnable* runnable) {
+            if (auto* range = dynamic_cast<IRangeRunnable*>(runnable)) {
+                return range;
+            }
+            runnable_ = runnable;
+            return this;
+        }
+
+        void runRange(int begin, int end, int num_total_tasks) {
+            for (int i = begin; i < end; i++) {
+                runnable_->runTask(i, num_total_tasks);
+            }
+        }
+
+    private:
+        IRunnable* runnable_ = nullptr;
+};
+
+
 /*
  * TaskSystemParallelThreadPoolSpinning: This class is the student's
  * implementation of a parallel task execution engine that uses a
@@ -54,42 +255,738 @@ class TaskSystemParallelSpawn: public ITaskSystem {
  */
 class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
     public:
-        TaskSystemParallelThreadPoolSpinning(int num_threads);
+        TaskSystemParallelThreadPoolSpinning(
+            int num_threads, const PoolConfig& config = PoolConfig::fromEnv());
         ~TaskSystemParallelThreadPoolSpinning();
         const char* name();
         void run(IRunnable* runnable, int num_total_tasks);
+        void run(IRunnable* runnable, int num_total_tasks,
+                 const LaunchOptions& options);
+        using ITaskSystem::runAsyncWithDeps;
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
+        using ITaskSystem::sync;
         void sync();
+        int numWorkerContexts();
     private:
+        // claims and runs chunks of the current launch until none are
+        // left, on the thread with worker index `index`
+        void runClaimed(int index);
+        // claims up to `grain` ids of launch `launch`, returns the first
+        // or num_total_tasks if it has none left
+        int claimIds(uint64_t launch, int grain, int num_total_tasks);
+
+        PoolConfig config;
+
         int num_threads;
         std::vector<std::thread> threads;
+        // one per worker, the last one is the thread in run()'s
+        WorkerContexts contexts;
 
 
         std::atomic_int num_finished;
-        std::atomic_int num_started;
+        // the launch's generation in the high 32 bits, the next id nobody
+        // claimed in the low ones, so a worker still on an earlier launch
+        // cannot claim ids of this one
+        std::atomic_uint64_t num_started;
 
-        IRunnable* _runnable;
-        int _num_total_tasks;
+        // published by bumping generation, a worker still reading them
+        // for an earlier launch finds no ids left to claim
+        std::atomic<IRangeRunnable*> _runnable;
+        RangeAdapter _adapter;
+        std::atomic_int _num_total_tasks;
+        std::atomic_int _grain_size;
+        std::atomic<int64_t> ns_per_task;  // Adaptive grain only
+        // first exception a task of the launch threw, guarded by mu
+        std::exception_ptr error;
+
+        // bumped by run() once a launch is published
+        std::atomic_uint64_t generation;
+        EventCount work_event;
+        EventCount done_event;
 
         std::mutex mu;
 
-        bool shutdown;
+        std::atomic_bool shutdown;
 };
 
 
+struct Task;
+
+/*
+ * StreamState: what the pool keeps of one TaskStream. `lane` is the
+ * stream's queue in the pool's FairQueues, lane 0 holds the pool's own
+ * launches.
+ */
+struct StreamState {
+    int lane;
+    std::atomic_int num_pending{0};  // launches not done yet
+    // done launches that were cancelled, kept like the pool's own until
+    // the stream's sync(). Guarded by the pool's mu
+    std::vector<Task*> cancelled_launches;
+};
+
+/*
+ * Edge: one dependency of `successor` on some predecessor launch. Edges are
+ * owned by the successor and linked into the predecessor's successor list.
+ * An element-wise edge lets each task id of the successor go as soon as the
+ * same id of the predecessor is done.
+ */
+struct Edge {
+    Task* predecessor;
+    TaskID predecessor_id;         // the record may be reused once it is done
+    Task* successor;
+    Edge* next;
+    bool elementwise;
+};
+
+/*
+ * Task: the bookkeeping of one bulk task launch.
+ *
+ * `successors` is a lock-free stack of the edges of launches waiting on this
+ * one. Finishing the launch swaps in a closed marker and walks the edges it
+ * got back, so a launch is done exactly when its list is closed.
+ *
+ * `num_waiting` counts unfinished predecessors, plus one held by
+ * runAsyncWithDeps() while it is still registering edges. Whoever drops it
+ * to zero releases the launch. Releasing tags the launch's own successor
+ * list, element-wise edges can only be linked before that.
+ *
+ * With `waits_per_id` set, the launch has element-wise edges and entry i of
+ * `id_waiting` counts the element-wise predecessors whose task i is not
+ * done, plus one dropped for every id when the launch is released. Whoever
+ * drops an entry to zero queues that task id.
+ *
+ * `edges` points at `inline_edges` for launches with up to kInlineEdges
+ * dependencies still running at submit, and into `spilled_edges` for
+ * bigger ones.
+ *
+ * Records are reused, see LaunchSlab. A reused record gets a new `id`, and
+ * keeps the storage of `spilled_edges` and `id_waiting` for its next launch.
+ */
 struct Task {
-    TaskID id;
+    std::atomic<TaskID> id;
+    uint64_t seq;                  // submission order, ReadyHeap only
+    uint32_t slot;                 // LaunchSlab only
+    std::atomic<uint32_t> next_free;
+
     IRunnable* runnable;
+    IRangeRunnable* range;         // runnable, or adapter running it
+    RangeAdapter adapter;
     int num_total_tasks;
-    
-    int num_started;
-    int num_finished;
+
+    int grain_size;                // LaunchOptions::grain_size
+
+    int num_started;               // GlobalQueue mode only, guarded by mu
+    std::atomic_int num_finished;
+    std::atomic<int64_t> ns_per_task;  // Adaptive grain only
+
+    std::atomic_int num_waiting;
+    std::atomic<Edge*> successors;
+    // submitters linking an edge to the launch, the record is not reused
+    // while there are any
+    std::atomic_int num_linking;
+
+    // one per dependency still running at submit
+    static constexpr int kInlineEdges = 4;
+    Edge* edges;
+    int num_edges;
+    Edge inline_edges[kInlineEdges];
+    std::vector<Edge> spilled_edges;
+
+    bool waits_per_id;
+    std::unique_ptr<std::atomic_int[]> id_waiting;
+    int id_waiting_capacity = 0;
+    std::atomic_bool has_elementwise_successors;
+
+    // ReadyOrder::CriticalPath only
+    int64_t cost;                  // guarded by mu
+    std::atomic<int64_t> bottom_level;
+    // in ready_heap, guarded like ready_heap. Always false once the launch
+    // is done, so reuse leaves it alone
+    bool queued = false;
+    const std::type_info* type;    // CostModel::Measured only
+    std::atomic<int64_t> busy_ns;  // CostModel::Measured only
+
+    int priority;                  // LaunchOptions::priority
+    StreamState* stream;           // nullptr for the pool's own launches
+    // for PriorityStats, steady_clock nanoseconds
+    int64_t submit_ns;
+    int64_t ready_ns;
+    std::atomic_bool started;
+
+    // a task inside the pool waits for this launch
+    std::atomic_bool joined;
+
+    // unclaimed task ids are skipped. was_cancelled is what cancelled
+    // read as the launch finished, the status wait() reports
+    std::atomic_bool cancelled;
+    std::atomic_bool was_cancelled;
+
+    // first exception one of the tasks threw, the launch is cancelled
+    // with it. Guarded by mu, like whether wait() or run() rethrew it
+    std::exception_ptr error;
+    bool error_reported;
+
+    // launch of a replayed TaskGraph, its successors never change
+    bool frozen;
+    std::vector<Task*> frozen_successors;
 };
 
-struct WaitTask {
-    std::vector<TaskID> waiting_for;
-    Task task;
+/*
+ * LaunchSlab: the launch records of TaskSystemParallelThreadPoolSleeping.
+ *
+ * A record goes back on a free list as soon as its launch is done and is
+ * handed out again to a later launch, so the pool keeps as many records as
+ * it ever had launches in flight at once. Records live in blocks of
+ * doubling size that are never moved or freed before the slab, a record
+ * found by slot number stays readable no matter what happens to its launch.
+ *
+ * alloc() and free() may be called from any thread, the head of the free
+ * list carries a count bumped on every change against ABA. A record some
+ * submitter is linking an edge to (Task::num_linking) is not handed out.
+ * While hold() is in effect, alloc() only hands out records that were free
+ * before or never had a launch, so a record freed meanwhile keeps what the
+ * launch it had left in it.
+ */
+class LaunchSlab {
+    public:
+        LaunchSlab() : free_head(0), num_slots(0), num_holds(0) {
+            for (auto& block : blocks) {
+                block.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~LaunchSlab() {
+            for (auto& block : blocks) {
+                delete[] block.load(std::memory_order_relaxed);
+            }
+        }
+
+        LaunchSlab(const LaunchSlab&) = delete;
+        LaunchSlab& operator=(const LaunchSlab&) = delete;
+
+        /*
+         * A record for a new launch. `claim(task)` gives it its new id,
+         * the caller sets up the rest afterwards.
+         */
+        template <typename Claim>
+        Task* alloc(Claim&& claim) {
+            uint64_t head = free_head.load(std::memory_order_acquire);
+            while (slotOf(head) != 0) {
+                Task* task    = at(slotOf(head) - 1);
+                uint64_t next = pack(
+                    head, task->next_free.load(std::memory_order_relaxed));
+                if (!free_head.compare_exchange_weak(
+                        head, next, std::memory_order_seq_cst,
+                        std::memory_order_acquire)) {
+                    continue;
+                }
+                // checked once the record is off the list, against hold()
+                // and submitters counting themselves in num_linking before
+                // they read its successor list
+                if (num_holds.load() == 0 && task->num_linking.load() == 0) {
+                    claim(task);
+                    return task;
+                }
+                // it goes back for later, this launch takes a new one
+                free(task);
+                break;
+            }
+
+            uint32_t slot = num_slots.fetch_add(1, std::memory_order_relaxed);
+            int b         = blockOf(slot);
+            if (blocks[b].load(std::memory_order_acquire) == nullptr) {
+                // whoever loses the race drops its block
+                Task* block     = new Task[kFirstBlock << b];
+                Task* expected  = nullptr;
+                if (!blocks[b].compare_exchange_strong(
+                        expected, block, std::memory_order_acq_rel)) {
+                    delete[] block;
+                }
+            }
+            Task* task = at(slot);
+            task->slot = slot;
+            claim(task);
+            return task;
+        }
+
+        void free(Task* task) {
+            uint64_t head = free_head.load(std::memory_order_relaxed);
+            do {
+                task->next_free.store(slotOf(head), std::memory_order_relaxed);
+            } while (!free_head.compare_exchange_weak(
+                head, pack(head, task->slot + 1), std::memory_order_release,
+                std::memory_order_relaxed));
+        }
+
+        // the record in `slot`, or nullptr if there never was one
+        Task* find(uint32_t slot) const {
+            if (blocks[blockOf(slot)].load(std::memory_order_acquire) ==
+                nullptr) {
+                return nullptr;
+            }
+            return at(slot);
+        }
+
+        void hold() { num_holds.fetch_add(1); }
+
+        void release() { num_holds.fetch_sub(1); }
+
+    private:
+        static constexpr uint32_t kFirstBlock = 64;
+        // enough blocks for every 32-bit slot number
+        static constexpr int kNumBlocks = 27;
+
+        // block b holds slots [64 * (2^b - 1), 64 * (2^(b+1) - 1))
+        static int blockOf(uint32_t slot) {
+            return std::bit_width((slot / kFirstBlock) + 1) - 1;
+        }
+
+        // a free list head is slot + 1, 0 if empty, below a change count
+        static uint32_t slotOf(uint64_t head) {
+            return static_cast<uint32_t>(head);
+        }
+
+        static uint64_t pack(uint64_t previous, uint32_t slot) {
+            return ((previous >> 32) + 1) << 32 | slot;
+        }
+
+        // `slot` must be in a block that exists
+        Task* at(uint32_t slot) const {
+            int b = blockOf(slot);
+            return blocks[b].load(std::memory_order_acquire) + slot -
+                   kFirstBlock * ((uint32_t{1} << b) - 1);
+        }
+
+        std::atomic<Task*> blocks[kNumBlocks];
+        std::atomic<uint64_t> free_head;
+        std::atomic<uint32_t> num_slots;
+        std::atomic_int num_holds;
+};
+
+/*
+ * RingQueue: a FIFO queue on a ring that doubles when full and never
+ * shrinks, a queue that stays about the same size allocates nothing.
+ */
+template <typename T>
+class RingQueue {
+    public:
+        bool empty() const { return head == tail; }
+
+        T& front() { return ring[head & (ring.size() - 1)]; }
+
+        void push_back(const T& value) {
+            if (tail - head == ring.size()) {
+                grow();
+            }
+            ring[tail & (ring.size() - 1)] = value;
+            tail++;
+        }
+
+        void pop_front() { head++; }
+
+        bool contains(const T& value) const {
+            for (size_t i = head; i < tail; i++) {
+                if (ring[i & (ring.size() - 1)] == value) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // drops the first item equal to `value`, the ones behind move up
+        void erase(const T& value) {
+            size_t mask = ring.size() - 1;
+            size_t i    = head;
+            while (i < tail && !(ring[i & mask] == value)) {
+                i++;
+            }
+            if (i == tail) {
+                return;
+            }
+            for (; i + 1 < tail; i++) {
+                ring[i & mask] = ring[(i + 1) & mask];
+            }
+            tail--;
+        }
+
+    private:
+        void grow() {
+            std::vector<T> bigger(std::max<size_t>(2 * ring.size(), 16));
+            for (size_t i = head; i < tail; i++) {
+                bigger[i - head] = ring[i & (ring.size() - 1)];
+            }
+            tail -= head;
+            head = 0;
+            ring.swap(bigger);
+        }
+
+        std::vector<T> ring;
+        size_t head = 0;
+        size_t tail = 0;
+};
+
+/*
+ * FairQueue: one RingQueue per lane, served in turn, one item per lane. An
+ * item never waits behind more than one item of each other lane that has
+ * some queued. front() and pop_front() work on the lane whose turn it is.
+ */
+template <typename T>
+class FairQueue {
+    public:
+        bool empty() const { return turns.empty(); }
+
+        T& front() { return lanes[turns.front()].front(); }
+
+        void push_back(int lane, const T& value) {
+            if (lane >= static_cast<int>(lanes.size())) {
+                lanes.resize(lane + 1);
+            }
+            if (lanes[lane].empty()) {
+                turns.push_back(lane);
+            }
+            lanes[lane].push_back(value);
+        }
+
+        void pop_front() {
+            int lane = turns.front();
+            turns.pop_front();
+            lanes[lane].pop_front();
+            if (!lanes[lane].empty()) {
+                turns.push_back(lane);
+            }
+        }
+
+        bool contains(const T& value) const {
+            for (const RingQueue<T>& lane : lanes) {
+                if (lane.contains(value)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // takes `value` out of its lane wherever it is queued
+        void erase(const T& value) {
+            for (size_t lane = 0; lane < lanes.size(); lane++) {
+                if (lanes[lane].contains(value)) {
+                    lanes[lane].erase(value);
+                    if (lanes[lane].empty()) {
+                        turns.erase(static_cast<int>(lane));
+                    }
+                    return;
+                }
+            }
+        }
+
+    private:
+        std::vector<RingQueue<T>> lanes;
+        RingQueue<int> turns;  // lanes with items queued, each once
+};
+
+/*
+ * MpmcRing: a bounded lock-free FIFO queue for any number of threads on
+ * either end, after Vyukov. Every cell carries the position it is due to
+ * be written or read at next, so pushing or popping is a single CAS on
+ * that end of the ring. push() fails once the ring is full, pop() while
+ * it is empty, or while the next item is still being written.
+ */
+template <typename T, size_t kCapacity>
+class MpmcRing {
+        static_assert(std::has_single_bit(kCapacity));
+
+    public:
+        MpmcRing() : head(0), tail(0) {
+            for (size_t i = 0; i < kCapacity; i++) {
+                cells[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        bool push(const T& value) {
+            size_t pos = tail.load(std::memory_order_relaxed);
+            while (true) {
+                Cell& cell = cells[pos & (kCapacity - 1)];
+                size_t seq = cell.seq.load(std::memory_order_acquire);
+                auto diff  = static_cast<std::ptrdiff_t>(seq - pos);
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(
+                            pos, pos + 1, std::memory_order_relaxed)) {
+                        cell.value = value;
+                        cell.seq.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool pop(T& value) {
+            size_t pos = head.load(std::memory_order_relaxed);
+            while (true) {
+                Cell& cell = cells[pos & (kCapacity - 1)];
+                size_t seq = cell.seq.load(std::memory_order_acquire);
+                auto diff  = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+                if (diff == 0) {
+                    if (head.compare_exchange_weak(
+                            pos, pos + 1, std::memory_order_relaxed)) {
+                        value = cell.value;
+                        cell.seq.store(pos + kCapacity,
+                                       std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> seq;
+            T value;
+        };
+
+        Cell cells[kCapacity];
+        // pushers and poppers keep to their own cache line
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) std::atomic<size_t> tail;
+};
+
+/*
+ * GraphReplay: the launch records of one TaskGraph. They are built on the
+ * graph's first runGraph() and reset in place by every later one, a replay
+ * allocates nothing and takes no lock per launch besides the ones
+ * releaseLaunch() takes anyway.
+ */
+struct GraphReplay {
+    std::unique_ptr<Task[]> nodes;
+    std::atomic_bool busy;         // a runGraph() is using the records
+    std::weak_ptr<const void> graph;  // TaskGraph::lifetime()
+};
+
+/*
+ * ReadyHeap: ready launches by bottom level, ties go to the older launch.
+ *
+ * A launch whose bottom level goes up while it waits is pushed once more
+ * rather than moved, pop() marks the launch as gone and top() drops the
+ * leftover entries of launches that are gone, including those whose record
+ * went on to another launch.
+ */
+class ReadyHeap {
+    public:
+        void push(Task* task) {
+            if (!task->queued) {
+                live++;
+            }
+            task->queued = true;
+            heap.push(Entry{task->bottom_level.load(std::memory_order_relaxed),
+                            task->seq, task,
+                            task->id.load(std::memory_order_relaxed)});
+        }
+
+        // needs at least one launch still queued
+        Task* top() {
+            while (heap.top().task->id.load(std::memory_order_relaxed) !=
+                       heap.top().id ||
+                   !heap.top().task->queued) {
+                heap.pop();
+            }
+            return heap.top().task;
+        }
+
+        void pop() {
+            top()->queued = false;
+            heap.pop();
+            live--;
+        }
+
+        // its entries stay in the heap, top() skips them
+        void erase(Task* task) {
+            if (task->queued) {
+                task->queued = false;
+                live--;
+            }
+        }
+
+        bool empty() const { return live == 0; }
+
+    private:
+        struct Entry {
+            int64_t level;
+            uint64_t seq;
+            Task* task;
+            TaskID id;
+
+            bool operator<(const Entry& other) const {
+                if (level != other.level) {
+                    return level < other.level;
+                }
+                return seq > other.seq;
+            }
+        };
+
+        std::priority_queue<Entry> heap;
+        int live = 0;  // launches still queued
+};
+
+/*
+ * PriorityPicker: which priority class to serve next, for work kept in one
+ * queue per class. The highest class with work goes first. A class with
+ * work that keeps being passed over goes ahead of the higher ones once it
+ * waited for `aging_ns`, just once, then it waits anew. The clock is only
+ * read while some class is passed over. Guarded by the lock of the queues
+ * picked from.
+ */
+class PriorityPicker {
+    public:
+        // the class to serve, or -1 if `has_work(c)` holds for none
+        template <typename HasWork, typename Now>
+        int pick(HasWork&& has_work, int64_t aging_ns, Now&& now) {
+            int best = -1;
+            int aged = -1;
+            int64_t now_ns = 0;
+            for (int c = 0; c < kNumLaunchPriorities; c++) {
+                if (!has_work(c)) {
+                    passed_since[c] = 0;
+                    continue;
+                }
+                if (best < 0) {
+                    best = c;
+                    continue;
+                }
+                if (aging_ns <= 0) {
+                    continue;
+                }
+                if (now_ns == 0) {
+                    now_ns = now();
+                }
+                if (passed_since[c] == 0) {
+                    passed_since[c] = now_ns;
+                } else if (aged < 0 && now_ns - passed_since[c] >= aging_ns) {
+                    aged = c;
+                }
+            }
+            int chosen = aged >= 0 ? aged : best;
+            if (chosen >= 0) {
+                passed_since[chosen] = 0;
+            }
+            return chosen;
+        }
+
+    private:
+        int64_t passed_since[kNumLaunchPriorities] = {};
+};
+
+/*
+ * LatencyStats: a distribution of latencies in nanoseconds. buckets[b]
+ * counts the ones below 2^b that are not below 2^(b-1).
+ */
+struct LatencyStats {
+    int64_t count    = 0;
+    int64_t total_ns = 0;
+    int64_t max_ns   = 0;
+    std::array<int64_t, 64> buckets{};
+
+    double meanNs() const {
+        return count == 0 ? 0 : static_cast<double>(total_ns) / count;
+    }
+
+    // an upper bound on the p-quantile, p in [0, 1]
+    int64_t quantileNs(double p) const {
+        int64_t rank = static_cast<int64_t>(p * count);
+        int64_t seen = 0;
+        for (int b = 0; b < 63; b++) {
+            seen += buckets[b];
+            if (seen > rank) {
+                return std::min<int64_t>(int64_t(1) << b, max_ns);
+            }
+        }
+        return max_ns;
+    }
+};
+
+/*
+ * PriorityStats: what launches of one priority class waited for.
+ *
+ *  - wait: from the moment the launch is ready to run until its first
+ *    task starts.
+ *  - latency: from submission until the launch is done.
+ */
+struct PriorityStats {
+    LatencyStats wait;
+    LatencyStats latency;
+};
+
+/*
+ * PoolSizeStats: how the worker count of an elastic pool changed, see
+ * PoolConfig::min_workers. `history` holds the last kMaxHistory changes,
+ * oldest first, each with the time since the pool started (or the stats
+ * were reset) and the worker count from then on. Its first entry is the
+ * count at that start.
+ */
+struct PoolSizeSample {
+    int64_t time_ns;
+    int num_workers;
+};
+
+struct PoolSizeStats {
+    static constexpr size_t kMaxHistory = 4096;
+
+    int num_workers     = 0;
+    int peak_workers    = 0;
+    int64_t num_grown   = 0;
+    int64_t num_retired = 0;
+    std::deque<PoolSizeSample> history;
+};
+
+/*
+ * LatencyRecorder: collects LatencyStats from any thread.
+ */
+class LatencyRecorder {
+    public:
+        void record(int64_t ns) {
+            ns = std::max<int64_t>(ns, 0);
+            count.fetch_add(1, std::memory_order_relaxed);
+            total_ns.fetch_add(ns, std::memory_order_relaxed);
+            int64_t max = max_ns.load(std::memory_order_relaxed);
+            while (ns > max && !max_ns.compare_exchange_weak(
+                                   max, ns, std::memory_order_relaxed)) {
+            }
+            buckets[std::bit_width(static_cast<uint64_t>(ns)) & 63]
+                .fetch_add(1, std::memory_order_relaxed);
+        }
+
+        LatencyStats snapshot() const {
+            LatencyStats stats;
+            stats.count    = count.load(std::memory_order_relaxed);
+            stats.total_ns = total_ns.load(std::memory_order_relaxed);
+            stats.max_ns   = max_ns.load(std::memory_order_relaxed);
+            for (int b = 0; b < 64; b++) {
+                stats.buckets[b] = buckets[b].load(std::memory_order_relaxed);
+            }
+            return stats;
+        }
+
+        void reset() {
+            count.store(0, std::memory_order_relaxed);
+            total_ns.store(0, std::memory_order_relaxed);
+            max_ns.store(0, std::memory_order_relaxed);
+            for (auto& bucket : buckets) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        std::atomic<int64_t> count{0};
+        std::atomic<int64_t> total_ns{0};
+        std::atomic<int64_t> max_ns{0};
+        std::atomic<int64_t> buckets[64] = {};
 };
 
 /*
@@ -100,37 +997,255 @@ struct WaitTask {
  */
 class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
     public:
-        TaskSystemParallelThreadPoolSleeping(int num_threads);
+        TaskSystemParallelThreadPoolSleeping(
+            int num_threads, const PoolConfig& config = PoolConfig::fromEnv());
         ~TaskSystemParallelThreadPoolSleeping();
         const char* name();
         void run(IRunnable* runnable, int num_total_tasks);
+        void run(IRunnable* runnable, int num_total_tasks,
+                 const LaunchOptions& options);
+        using ITaskSystem::runAsyncWithDeps;
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                const std::vector<TaskID>& deps,
+                                const LaunchOptions& options);
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                std::span<const TaskID> deps,
+                                const LaunchOptions& options);
+        using ITaskSystem::tryRunAsyncWithDeps;
+        std::optional<TaskID> tryRunAsyncWithDeps(
+            IRunnable* runnable, int num_total_tasks,
+            std::span<const TaskID> deps, const LaunchOptions& options);
+        void runGraph(const TaskGraph& graph);
         void sync();
+        void sync(std::vector<TaskID>& cancelled);
+        LaunchStatus wait(TaskID task_id);
+        bool isDone(TaskID task_id);
+        bool cancel(TaskID task_id);
+        std::unique_ptr<ITaskSystem> createStream();
+        bool supportsConcurrentSubmit();
+        int numWorkerContexts();
+
+        // per class, since the pool started or the last reset
+        PriorityStats priorityStats(LaunchPriority priority) const;
+        void resetPriorityStats();
+        // since the pool started or the last reset
+        PoolSizeStats poolSizeStats();
+        void resetPoolSizeStats();
     private:
+        friend class TaskStream;
+
+        Task* findLaunch(TaskID task_id);
+        LaunchStatus statusOf(TaskID task_id);
+        void finishRun(TaskID task_id);
+        std::exception_ptr takeError(TaskID task_id);
+        std::exception_ptr dropCancelled(std::vector<Task*>& launches,
+                                         std::vector<TaskID>* ids);
+        void cancelFrom(Task* root);
+        void failLaunch(Task* task);
+        std::unique_ptr<GraphReplay> buildReplay(const TaskGraph& graph);
+        TaskID submit(IRunnable* runnable, int num_total_tasks,
+                      std::span<const TaskID> deps,
+                      const LaunchOptions& options, WorkDeque* local,
+                      bool limited = false, StreamState* stream = nullptr);
+        TaskID submitAsync(IRunnable* runnable, int num_total_tasks,
+                           std::span<const TaskID> deps,
+                           const LaunchOptions& options, StreamState* stream);
+        std::optional<TaskID> trySubmitAsync(IRunnable* runnable,
+                                             int num_total_tasks,
+                                             std::span<const TaskID> deps,
+                                             const LaunchOptions& options,
+                                             StreamState* stream);
+        int openLane();
+        void closeLane(int lane);
+        bool limited() const {
+            return config.max_pending_launches > 0 ||
+                   config.max_pending_tasks > 0;
+        }
+        bool hasRoom(int num_total_tasks);
+        bool reserve(int num_total_tasks, bool limited);
+        bool fits(int launches, int64_t tasks, int num_total_tasks) const;
+        void waitForRoom(int num_total_tasks);
+        template <typename Pred>
+        void helpUntil(EventCount& event, Pred&& done);
+        template <typename Pred>
+        void helpOrWait(EventCount& event, Pred&& done);
+        void helpUntilDone();
+        void syncAll();
+        void syncNested();
+        void joinLaunches(size_t first);
+        WorkDeque* currentDeque();
+
+        bool elastic() const {
+            return config.min_workers >= 0 && config.min_workers < num_threads;
+        }
+        void startWorker(int index);
+        bool retireWorker(int index);
+        void recordPoolSize(int64_t now);
+        void sizerLoop();
+        bool hasBacklog();
+        void workerLoop(int index);
+        void globalWorkerLoop(int index);
+        bool runGlobalChunk();
+        WorkItem claimChunk(Task* task);
+        bool claimLaunchChunk(Task* task, TaskID task_id, WorkItem& item);
+        bool claimJoinedChunk(size_t first, size_t last, WorkItem& item);
+        void runGlobalItem(WorkItem item);
+        bool findWork(int index, std::minstd_rand& rng, WorkItem& item);
+        bool takeInjected(WorkItem& item);
+        void runItem(WorkDeque& local, WorkItem item);
+        void runChunk(Task* task, int begin, int end);
+
+        enum class LinkResult { Linked, Done, Released };
+        LinkResult addSuccessor(Task* pred, Edge* edge);
+        void releaseIds(Task* task, int begin, int end, WorkDeque* local);
+        void pushItem(WorkItem item, WorkDeque* local);
+        void drainReady();
+        void drainInjected();
+        int64_t launchCost(const Task* task);
+        void raiseBottomLevels(Task* task);
+        void releaseLaunch(Task* task, WorkDeque* local);
+        void finishLaunch(Task* task, WorkDeque* local);
+        void notifyWork(bool all = false);
+        void wakeSizer();
+
         std::mutex mu;
-        std::condition_variable start_cv;
-        std::condition_variable finish_cv;
-        
-        
-        
-        
-        TaskID next_task_id;
-        std::vector<WaitTask> waiting_tasks;
-        std::deque<Task> ready_tasks;
-        std::vector<Task> running_tasks;
-        
+
+        PoolConfig config;
+
+        uint64_t next_seq;  // ReadyOrder::CriticalPath only, guarded by mu
+        LaunchSlab launches;
+        // GlobalQueue mode only, by priority. Released launches go into
+        // the lock-free ready_inbox, or straight to ready_tasks with mu
+        // held if it is full. Workers move them on to ready_tasks with mu
+        // held before they pick one
+        static constexpr size_t kInboxSize = 256;
+        MpmcRing<Task*, kInboxSize> ready_inbox[kNumLaunchPriorities];
+        FairQueue<Task*> ready_tasks[kNumLaunchPriorities];
+        std::atomic_int num_ready;          // launches in both
+        std::atomic_int num_pending;        // launches not done yet
+        std::atomic<int64_t> pending_tasks; // their tasks
+
+        // ReadyOrder::CriticalPath, replaces ready_tasks and injection.
+        // Guarded by mu in GlobalQueue mode and by inject_mu otherwise.
+        ReadyHeap ready_heap[kNumLaunchPriorities];
+        // picks among ready_tasks / ready_heap / injection, guarded the
+        // same way
+        PriorityPicker picker;
+        std::vector<Task*> level_stack;     // guarded by mu
+        // CostModel::Measured, guarded by mu
+        std::unordered_map<std::type_index, int64_t> ns_per_task_by_type;
+        int64_t ns_per_task_any;
+
+        // done launches that were cancelled, their records stay out of
+        // reuse until the next sync() reports them. Guarded by mu
+        std::vector<Task*> cancelled_launches;
+
+        // by TaskGraph::id(), guarded by mu. Replays of graphs that are
+        // gone are dropped whenever another one is built
+        std::unordered_map<uint64_t, std::unique_ptr<GraphReplay>> replays;
+
+        // lanes of TaskStreams, guarded by mu
+        int num_lanes;
+        std::vector<int> free_lanes;
+
+        // WorkStealing mode
+        std::mutex inject_mu;
+        // by priority, launches other than Normal ones go here even when
+        // a worker releases them. Like ready_inbox and ready_tasks
+        MpmcRing<WorkItem, kInboxSize> injection_inbox[kNumLaunchPriorities];
+        FairQueue<WorkItem> injection[kNumLaunchPriorities];
+        std::atomic_int num_injected;
+        std::atomic_int num_injected_high;  // LaunchPriority::High only
+        std::vector<std::unique_ptr<WorkDeque>> deques;
+        // set while an outside thread in run(), wait() or sync() joins the
+        // workers, at most one does. It gets the last deque and the last
+        // worker context
+        std::atomic_bool caller_busy;
+
+        // idle workers park on work_event, sync() parks on done_event,
+        // submitters held back by the limits park on room_event
+        EventCount work_event;
+        EventCount done_event;
+        EventCount room_event;
+
+        LatencyRecorder wait_stats[kNumLaunchPriorities];
+        LatencyRecorder latency_stats[kNumLaunchPriorities];
+
         int num_threads;
+        // by worker index, an elastic pool leaves the slots of workers
+        // it does not run empty. Only the sizer thread touches them
+        // after the constructor
         std::vector<std::thread> threads;
-        
-        std::thread daemon;
-
-        IRunnable* _runnable;
-        int _num_total_tasks;
-        
-        bool has_work;
-        bool shutdown;
-        bool work_finished;
+        std::vector<int> placement;  // CPUs by worker index, if pinned
+
+        // elastic pools only. The sizer adds workers, workers retire
+        // themselves. It parks on sizer_event while no ready work waits
+        std::thread sizer;
+        EventCount sizer_event;
+        std::mutex size_mu;
+        std::atomic_int num_workers;
+        std::vector<bool> worker_running;  // by index, guarded by size_mu
+        int64_t size_start_ns;             // guarded by size_mu
+        PoolSizeStats size_stats;          // guarded by size_mu
+
+        WorkerContexts contexts;  // by worker index, see caller_busy
+
+        std::atomic_bool shutdown;
+};
+
+/*
+ * TaskStream: a submission stream on a TaskSystemParallelThreadPoolSleeping,
+ * see ITaskSystem::createStream(). Its launches run on the pool's threads
+ * under the pool's limits on pending work, and the pool's sync() waits for
+ * them too. Stream ids count up from 0 and name nothing outside the stream,
+ * ids from before the stream's last sync() read as done.
+ *
+ * Ready launches of a stream queue in its own lane and lanes are served in
+ * turn, so a stream with a long backlog holds up the next launch of another
+ * stream by one launch at most. With ReadyOrder::CriticalPath, levels rank
+ * launches across streams instead.
+ */
+class TaskStream: public ITaskSystem {
+    public:
+        TaskStream(TaskSystemParallelThreadPoolSleeping* pool);
+        ~TaskStream();
+        const char* name();
+        void run(IRunnable* runnable, int num_total_tasks);
+        void run(IRunnable* runnable, int num_total_tasks,
+                 const LaunchOptions& options);
+        using ITaskSystem::runAsyncWithDeps;
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                const std::vector<TaskID>& deps);
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                const std::vector<TaskID>& deps,
+                                const LaunchOptions& options);
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                std::span<const TaskID> deps,
+                                const LaunchOptions& options);
+        using ITaskSystem::tryRunAsyncWithDeps;
+        std::optional<TaskID> tryRunAsyncWithDeps(
+            IRunnable* runnable, int num_total_tasks,
+            std::span<const TaskID> deps, const LaunchOptions& options);
+        void sync();
+        void sync(std::vector<TaskID>& cancelled);
+        LaunchStatus wait(TaskID task_id);
+        bool isDone(TaskID task_id);
+        bool cancel(TaskID task_id);
+        int numWorkerContexts();
+    private:
+        TaskID poolId(TaskID task_id) const;
+        std::span<const TaskID> poolDeps(std::span<const TaskID> deps);
+        std::exception_ptr syncLaunches(std::vector<TaskID>* cancelled);
+
+        TaskSystemParallelThreadPoolSleeping* pool;
+        StreamState state;
+        // pool ids of the launches since the last sync(), the first one
+        // has stream id first_id
+        TaskID first_id;
+        std::vector<TaskID> pool_ids;
+        std::vector<TaskID> dep_ids;  // poolDeps() only
 };
 
 #endif
@@ -0,0 +1,227 @@
+#ifndef _TOPOLOGY_H
+#define _TOPOLOGY_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+ * CpuInfo: one logical CPU the process may run on. `core` numbers physical
+ * cores across the whole machine, hyperthreads of one core share it, and
+ * `smt` is the CPU's rank among its siblings.
+ */
+struct CpuInfo {
+    int cpu;
+    int package;
+    int core;
+    int smt;
+};
+
+/*
+ * Parses a kernel cpu list like "0-3,8,10-11". Returns an empty list if the
+ * text is not one.
+ */
+inline std::vector<int> parseCpuList(const char* text) {
+    std::vector<int> cpus;
+    while (*text != '\0' && *text != '\n') {
+        char* end;
+        long first = std::strtol(text, &end, 10);
+        if (end == text || first < 0) {
+            return {};
+        }
+        long last = first;
+        if (*end == '-') {
+            text = end + 1;
+            last = std::strtol(text, &end, 10);
+            if (end == text || last < first) {
+                return {};
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+        text = end;
+        if (*text == ',') {
+            text++;
+        }
+    }
+    return cpus;
+}
+
+inline bool readSysfs(const std::string& path, char* buf, size_t size) {
+    FILE* f = std::fopen(path.c_str(), "r");
+    if (f == nullptr) {
+        return false;
+    }
+    bool ok = std::fgets(buf, size, f) != nullptr;
+    std::fclose(f);
+    return ok;
+}
+
+inline int readSysfsInt(const std::string& path, int fallback) {
+    char buf[32];
+    return readSysfs(path, buf, sizeof(buf)) ? std::atoi(buf) : fallback;
+}
+
+/*
+ * CpuTopology: the CPUs this process is allowed on, as found under
+ * /sys/devices/system/cpu. Without sysfs every CPU counts as its own core.
+ */
+struct CpuTopology {
+    std::vector<CpuInfo> cpus;  // by package, core, then smt
+
+    static CpuTopology detect() {
+        const std::string root = "/sys/devices/system/cpu/";
+
+        char buf[4096];
+        std::vector<int> online;
+        if (readSysfs(root + "online", buf, sizeof(buf))) {
+            online = parseCpuList(buf);
+        }
+        if (online.empty()) {
+            int n = std::max<int>(std::thread::hardware_concurrency(), 1);
+            for (int cpu = 0; cpu < n; cpu++) {
+                online.push_back(cpu);
+            }
+        }
+
+#if defined(__linux__)
+        // leave out CPUs the process was restricted away from
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            std::erase_if(online, [&](int cpu) {
+                return cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed);
+            });
+        }
+#endif
+
+        CpuTopology topology;
+        std::vector<std::tuple<int, int, int>> cores;  // package, core_id, cpu
+        for (int cpu : online) {
+            std::string dir = root + "cpu" + std::to_string(cpu) + "/topology/";
+            int package     = readSysfsInt(dir + "physical_package_id", 0);
+            int core_id     = readSysfsInt(dir + "core_id", cpu);
+            cores.emplace_back(package, core_id, cpu);
+        }
+        std::sort(cores.begin(), cores.end());
+
+        int core = -1;
+        for (size_t i = 0; i < cores.size(); i++) {
+            auto [package, core_id, cpu] = cores[i];
+            bool sibling = i > 0 && std::get<0>(cores[i - 1]) == package &&
+                           std::get<1>(cores[i - 1]) == core_id;
+            int smt = sibling ? topology.cpus.back().smt + 1 : 0;
+            if (!sibling) {
+                core++;
+            }
+            topology.cpus.push_back(CpuInfo{cpu, package, core, smt});
+        }
+        return topology;
+    }
+};
+
+/*
+ * AffinityPolicy: where pool workers get pinned.
+ *
+ *  - None: nowhere, the OS places them.
+ *  - Compact: fill one core's hyperthreads, then the next core.
+ *  - Scatter: one worker per physical core first, hyperthread siblings only
+ *    once every core has one.
+ *  - Explicit: worker i goes to cpus[i % cpus.size()].
+ */
+enum class AffinityPolicy {
+    None,
+    Compact,
+    Scatter,
+    Explicit,
+};
+
+struct Affinity {
+    AffinityPolicy policy = AffinityPolicy::None;
+    std::vector<int> cpus;  // Explicit only
+
+    // "none", "compact", "scatter" or a cpu list like "0,2,4-7"
+    static Affinity parse(const char* text) {
+        Affinity affinity;
+        if (std::strcmp(text, "compact") == 0) {
+            affinity.policy = AffinityPolicy::Compact;
+        } else if (std::strcmp(text, "scatter") == 0) {
+            affinity.policy = AffinityPolicy::Scatter;
+        } else if (std::vector<int> cpus = parseCpuList(text); !cpus.empty()) {
+            affinity.policy = AffinityPolicy::Explicit;
+            affinity.cpus   = std::move(cpus);
+        }
+        return affinity;
+    }
+};
+
+/*
+ * The CPU for each of `num_workers` workers, or an empty list with
+ * AffinityPolicy::None. With more workers than CPUs the list wraps around.
+ */
+inline std::vector<int> placeWorkers(const Affinity& affinity,
+                                     const CpuTopology& topology,
+                                     int num_workers) {
+    std::vector<int> order;
+    switch (affinity.policy) {
+    case AffinityPolicy::None:
+        return {};
+    case AffinityPolicy::Explicit:
+        order = affinity.cpus;
+        break;
+    case AffinityPolicy::Compact:
+        for (const CpuInfo& info : topology.cpus) {
+            order.push_back(info.cpu);
+        }
+        break;
+    case AffinityPolicy::Scatter: {
+        std::vector<CpuInfo> cpus = topology.cpus;
+        std::stable_sort(cpus.begin(), cpus.end(),
+                         [](const CpuInfo& a, const CpuInfo& b) {
+                             return a.smt < b.smt;
+                         });
+        for (const CpuInfo& info : cpus) {
+            order.push_back(info.cpu);
+        }
+        break;
+    }
+    }
+    if (order.empty()) {
+        return {};
+    }
+
+    std::vector<int> placement;
+    for (int i = 0; i < num_workers; i++) {
+        placement.push_back(order[i % order.size()]);
+    }
+    return placement;
+}
+
+// pins `thread` to `cpu`, returns false if the OS refused
+inline bool pinThread(std::thread& thread, int cpu) {
+#if defined(__linux__)
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) ==
+           0;
+#else
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef _WSDEQUE_H
+#define _WSDEQUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+struct Task;
+
+/*
+ * WorkItem: a contiguous range [begin, end) of task ids of one bulk task
+ * launch. Items are split in half when they are bigger than the grain, the
+ * upper half goes back to the owner's deque where it can be stolen.
+ */
+struct WorkItem {
+    Task* task;
+    int begin;
+    int end;
+};
+
+/*
+ * WorkDeque: Chase-Lev work-stealing deque (the C11 formulation from
+ * "Correct and Efficient Work-Stealing for Weak Memory Models", Le et al.).
+ *
+ * The owner thread calls push() and take() on the bottom end, any other
+ * thread may call steal() on the top end. The ring grows on demand, old
+ * rings are kept until the deque dies since a thief may still be reading
+ * from them.
+ */
+class WorkDeque {
+    public:
+        enum class StealResult { Success, Empty, Abort };
+
+        WorkDeque(int log_capacity = 8)
+            : top(0), bottom(0), ring(new Ring(int64_t{1} << log_capacity)) {
+            retired.emplace_back(ring.load(std::memory_order_relaxed));
+        }
+
+        ~WorkDeque() {
+            for (Ring* r : retired) {
+                delete r;
+            }
+        }
+
+        WorkDeque(const WorkDeque&) = delete;
+        WorkDeque& operator=(const WorkDeque&) = delete;
+
+        // owner only
+        void push(WorkItem item) {
+            int64_t b = bottom.load(std::memory_order_relaxed);
+            int64_t t = top.load(std::memory_order_acquire);
+            Ring*   r = ring.load(std::memory_order_relaxed);
+            if (b - t > r->capacity - 1) {
+                r = grow(r, t, b);
+            }
+            r->put(b, item);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        // owner only
+        bool take(WorkItem& item) {
+            int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+            Ring*   r = ring.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t t = top.load(std::memory_order_relaxed);
+
+            if (t > b) {
+                // empty
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return false;
+            }
+            item = r->get(b);
+            if (t == b) {
+                // last item, race against thieves for it
+                bool won = top.compare_exchange_strong(
+                    t, t + 1, std::memory_order_seq_cst,
+                    std::memory_order_relaxed);
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return won;
+            }
+            return true;
+        }
+
+        // any thread
+        StealResult steal(WorkItem& item) {
+            int64_t t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = bottom.load(std::memory_order_acquire);
+            if (t >= b) {
+                return StealResult::Empty;
+            }
+            Ring* r = ring.load(std::memory_order_acquire);
+            item    = r->get(t);
+            if (!top.compare_exchange_strong(t, t + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed)) {
+                return StealResult::Abort;
+            }
+            return StealResult::Success;
+        }
+
+        // racy size estimate, only used as a hint
+        bool empty() const {
+            return bottom.load(std::memory_order_relaxed) <=
+                   top.load(std::memory_order_relaxed);
+        }
+
+    private:
+        /*
+         * Slots are made of individually atomic fields, a thief may read a
+         * slot while the owner writes it, the CAS on top tells the thief
+         * whether what it read is valid.
+         */
+        struct Slot {
+            std::atomic<Task*> task;
+            std::atomic_int    begin;
+            std::atomic_int    end;
+        };
+
+        struct Ring {
+            int64_t capacity;
+            Slot*   slots;
+
+            Ring(int64_t capacity)
+                : capacity(capacity), slots(new Slot[capacity]) {}
+
+            ~Ring() { delete[] slots; }
+
+            void put(int64_t i, WorkItem item) {
+                Slot& s = slots[i & (capacity - 1)];
+                s.task.store(item.task, std::memory_order_relaxed);
+                s.begin.store(item.begin, std::memory_order_relaxed);
+                s.end.store(item.end, std::memory_order_relaxed);
+            }
+
+            WorkItem get(int64_t i) const {
+                const Slot& s = slots[i & (capacity - 1)];
+                return WorkItem{s.task.load(std::memory_order_relaxed),
+                                s.begin.load(std::memory_order_relaxed),
+                                s.end.load(std::memory_order_relaxed)};
+            }
+        };
+
+        Ring* grow(Ring* old, int64_t t, int64_t b) {
+            Ring* r = new Ring(old->capacity * 2);
+            for (int64_t i = t; i < b; i++) {
+                r->put(i, old->get(i));
+            }
+            retired.push_back(r);
+            ring.store(r, std::memory_order_release);
+            return r;
+        }
+
+        alignas(64) std::atomic<int64_t> top;
+        alignas(64) std::atomic<int64_t> bottom;
+        std::atomic<Ring*> ring;
+        std::vector<Ring*> retired;  // owner only
+};
+
+#endif
@@ -49,7 +49,7 @@ ITaskSystem *selectTaskSystemRefImpl(int num_threads, TaskSystemType type) {
 
 int main(int argc, char** argv)
 {
-    const int n_tests = 31;
+    const int n_tests = 55;
     int num_threads = DEFAULT_NUM_THREADS;
     int num_timing_iterations = DEFAULT_NUM_TIMING_ITERATIONS;
 
@@ -83,6 +83,32 @@ int main(int argc, char** argv)
         strictGraphDepsSmall,
         strictGraphDepsMedium,
         strictGraphDepsLarge,
+        graphReplayTest,
+        graphResubmitTest,
+        superLightElementWiseAsyncTest,
+        nestedFibonacciTest,
+        nestedFibonacciAsyncTest,
+        waitSingleLaunchTest,
+        coroutinePipelineTest,
+        syncPipelineTest,
+        superSuperLightParallelForTest,
+        superSuperLightLaunchAsyncTest,
+        mathOperationsInTightForLoopSpanAsyncTest,
+        overloadAsyncTest,
+        priorityMixAsyncTest,
+        strictGraphDepsCancelTest,
+        throwingTaskTest,
+        streamsTest,
+        concurrentSubmitTest,
+        burstsTest,
+        workerContextTest,
+        simpleTestRangeAsync,
+        superSuperLightRangeTest,
+        pingPongEqualRangeTest,
+        pingPongEqualRangeAsyncTest,
+        cancelLaunchTest,
+        throwingLaunchTest,
+        graphThrowingTest,
     };
 
     std::string test_names[n_tests] = {
@@ -115,6 +141,32 @@ int main(int argc, char** argv)
         "strict_graph_deps_small_async",
         "strict_graph_deps_med_async",
         "strict_graph_deps_large_async",
+        "graph_replay_async",
+        "graph_resubmit_async",
+        "super_light_elementwise_async",
+        "recursive_fibonacci_nested",
+        "recursive_fibonacci_nested_async",
+        "wait_single_launch_async",
+        "coroutine_pipeline_async",
+        "sync_pipeline_async",
+        "super_super_light_parallel_for",
+        "super_super_light_launch_async",
+        "math_operations_in_tight_for_loop_span_async",
+        "overload_async",
+        "priority_mix_async",
+        "strict_graph_deps_cancel_async",
+        "throwing_task_async",
+        "streams_async",
+        "concurrent_submit_async",
+        "bursts_async",
+        "worker_context_async",
+        "simple_test_range_async",
+        "super_super_light_range",
+        "ping_pong_equal_range",
+        "ping_pong_equal_range_async",
+        "cancel_launch_async",
+        "throwing_launch_async",
+        "graph_throwing_async",
     };
  
     // Parse commandline options
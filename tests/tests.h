@@ -6,6 +6,7 @@
 #include <thread>
 #include <atomic>
 #include <set>
+#include <stdexcept>
 
 #include "CycleTimer.h"
 #include "itasksys.h"
@@ -37,6 +38,32 @@ TestResults mathOperationsInTightForLoopReductionTreeAsyncTest(ITaskSystem* t);
 TestResults spinBetweenRunCallsAsyncTest(ITaskSystem *t);
 TestResults mandelbrotChunkedAsyncTest(ITaskSystem* t);
 TestResults simpleRunDepsTest(ITaskSystem *t);
+TestResults graphReplayTest(ITaskSystem *t);
+TestResults graphResubmitTest(ITaskSystem *t);
+TestResults superLightElementWiseAsyncTest(ITaskSystem *t);
+TestResults nestedFibonacciTest(ITaskSystem *t);
+TestResults nestedFibonacciAsyncTest(ITaskSystem *t);
+TestResults waitSingleLaunchTest(ITaskSystem *t);
+TestResults coroutinePipelineTest(ITaskSystem *t);
+TestResults syncPipelineTest(ITaskSystem *t);
+TestResults superSuperLightParallelForTest(ITaskSystem *t);
+TestResults superSuperLightLaunchAsyncTest(ITaskSystem *t);
+TestResults mathOperationsInTightForLoopSpanAsyncTest(ITaskSystem *t);
+TestResults overloadAsyncTest(ITaskSystem *t);
+TestResults priorityMixAsyncTest(ITaskSystem *t);
+TestResults strictGraphDepsCancelTest(ITaskSystem *t);
+TestResults throwingTaskTest(ITaskSystem *t);
+TestResults streamsTest(ITaskSystem *t);
+TestResults concurrentSubmitTest(ITaskSystem *t);
+TestResults burstsTest(ITaskSystem *t);
+TestResults workerContextTest(ITaskSystem *t);
+TestResults simpleTestRangeAsync(ITaskSystem *t);
+TestResults superSuperLightRangeTest(ITaskSystem *t);
+TestResults pingPongEqualRangeTest(ITaskSystem *t);
+TestResults pingPongEqualRangeAsyncTest(ITaskSystem *t);
+TestResults cancelLaunchTest(ITaskSystem *t);
+TestResults throwingLaunchTest(ITaskSystem *t);
+TestResults graphThrowingTest(ITaskSystem *t);
 */
 
 /*
@@ -205,6 +232,67 @@ class PingPongTask : public IRunnable {
         }
 };
 
+/*
+ * SimpleMultiplyTask as an IRangeRunnable: a task system that knows about it
+ * makes one call per chunk of task ids, over the elements of all of them.
+ */
+class SimpleMultiplyRangeTask : public IRangeRunnable {
+    public:
+        int num_elements_;
+        int* array_;
+
+        SimpleMultiplyRangeTask(int num_elements, int* array)
+            : num_elements_(num_elements), array_(array) {}
+        ~SimpleMultiplyRangeTask() {}
+
+        void runRange(int begin, int end, int num_total_tasks) {
+            int elements_per_task = (num_elements_ + num_total_tasks-1) / num_total_tasks;
+            int start_el = elements_per_task * begin;
+            int end_el = std::min(elements_per_task * end, num_elements_);
+
+            for (int i=start_el; i<end_el; i++)
+                array_[i] = SimpleMultiplyTask::multiply_task(3, array_[i]);
+        }
+};
+
+/*
+ * PingPongTask as an IRangeRunnable, see SimpleMultiplyRangeTask.
+ */
+class PingPongRangeTask : public IRangeRunnable {
+    public:
+        int num_elements_;
+        int* input_array_;
+        int* output_array_;
+        bool equal_work_;
+        int iters_;
+
+        PingPongRangeTask(int num_elements, int* input_array, int* output_array,
+                          bool equal_work, int iters)
+            : num_elements_(num_elements), input_array_(input_array),
+              output_array_(output_array), equal_work_(equal_work),
+              iters_(iters) {}
+        ~PingPongRangeTask() {}
+
+        void runRange(int begin, int end, int num_total_tasks) {
+            int elements_per_task = (num_elements_ + num_total_tasks-1) / num_total_tasks;
+            int start_el = elements_per_task * begin;
+            int end_el = std::min(elements_per_task * end, num_elements_);
+
+            if (equal_work_) {
+                for (int i=start_el; i<end_el; i++)
+                    output_array_[i] = PingPongTask::ping_pong_work(
+                        iters_, input_array_[i]);
+            } else {
+                for (int i=start_el; i<end_el; i++) {
+                    int el_iters = PingPongTask::ping_pong_iters(
+                        i, num_elements_, iters_);
+                    output_array_[i] = PingPongTask::ping_pong_work(
+                        el_iters, input_array_[i]);
+                }
+            }
+        }
+};
+
 /*
  * Each task computes and writes the idx-th fibonacci number into the
  * position output[task_id].
@@ -227,6 +315,46 @@ class RecursiveFibonacciTask: public IRunnable {
         }
 };
 
+/*
+ * Task i computes the fibonacci number of index idx_[i] by launching the
+ * two smaller ones as a bulk task launch of its own, from inside runTask,
+ * down to index `cutoff_` where it switches to the slow serial recursion.
+ */
+class NestedFibonacciTask: public IRunnable {
+    public:
+        ITaskSystem* t_;
+        const int* idx_;
+        int* output_;
+        int cutoff_;
+        bool do_async_;
+        NestedFibonacciTask(ITaskSystem* t, const int* idx, int* output,
+                            int cutoff, bool do_async)
+            : t_(t), idx_(idx), output_(output), cutoff_(cutoff),
+              do_async_(do_async) {}
+        ~NestedFibonacciTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int idx = idx_[task_id];
+            if (idx <= cutoff_) {
+                output_[task_id] = RecursiveFibonacciTask(idx, NULL).slowFn(idx);
+                return;
+            }
+
+            int child_idx[2] = {idx - 1, idx - 2};
+            int child_output[2] = {0, 0};
+            NestedFibonacciTask child(t_, child_idx, child_output, cutoff_,
+                                      do_async_);
+            if (do_async_) {
+                std::vector<TaskID> deps;
+                t_->runAsyncWithDeps(&child, 2, deps);
+                t_->sync();
+            } else {
+                t_->run(&child, 2);
+            }
+            output_[task_id] = child_output[0] + child_output[1];
+        }
+};
+
 /*
  * Each task copies its task id into the output.
  */
@@ -505,6 +633,7 @@ class StrictDependencyTask: public IRunnable {
  * Debug information for students: to debug, consider setting breakpoints or
  * adding print statements in this function.
  */
+template <typename Task = SimpleMultiplyTask>
 TestResults simpleTest(ITaskSystem* t, bool do_async) {
     int num_elements_per_task = 2;
     int num_tasks = 3;
@@ -517,8 +646,8 @@ TestResults simpleTest(ITaskSystem* t, bool do_async) {
         array[i] = i + 1;
     }
 
-    SimpleMultiplyTask first = SimpleMultiplyTask(num_elements, array);
-    SimpleMultiplyTask second = SimpleMultiplyTask(num_elements, array);
+    Task first = Task(num_elements, array);
+    Task second = Task(num_elements, array);
 
     // Run the test
     double start_time = CycleTimer::currentSeconds();
@@ -567,6 +696,13 @@ TestResults simpleTestAsync(ITaskSystem* t) {
     return simpleTest(t, true);
 }
 
+/*
+ * simpleTest through IRangeRunnable::runRange().
+ */
+TestResults simpleTestRangeAsync(ITaskSystem* t) {
+    return simpleTest<SimpleMultiplyRangeTask>(t, true);
+}
+
 /*
  * Computation: pingPongTest launches 400 bulk task launches with 64 tasks each.
  * The computation done by each bulk task launch takes as input a buffer of size
@@ -584,8 +720,10 @@ TestResults simpleTestAsync(ITaskSystem* t) {
  * `base_iters`, because each task gets `num_elements` / `num_tasks` elements
  * and does O(base_iters) work per element.
  */
+template <typename Task = PingPongTask>
 TestResults pingPongTest(ITaskSystem* t, bool equal_work, bool do_async,
-                         int num_elements, int base_iters) {
+                         int num_elements, int base_iters,
+                         const LaunchOptions& options = LaunchOptions()) {
 
     int num_tasks = 64;
     int num_bulk_task_launches = 400;   
@@ -601,22 +739,22 @@ TestResults pingPongTest(ITaskSystem* t, bool equal_work, bool do_async,
 
     // Ping-pong input and output buffers with all the
     // back-to-back task launches
-    std::vector<PingPongTask*> runnables(
+    std::vector<Task*> runnables(
         num_bulk_task_launches);
     for (int i=0; i<num_bulk_task_launches; i++) {
         if (i % 2 == 0)
-            runnables[i] = new PingPongTask(
+            runnables[i] = new Task(
                 num_elements, input, output,
                 equal_work, base_iters);
         else
-            runnables[i] = new PingPongTask(
+            runnables[i] = new Task(
                 num_elements, output, input,
                 equal_work, base_iters);
     }
 
     // Run the test
     double start_time = CycleTimer::currentSeconds();
-    TaskID prev_task_id;
+    TaskID prev_task_id = 0;
     for (int i=0; i<num_bulk_task_launches; i++) {
         if (do_async) {
             std::vector<TaskID> deps;
@@ -624,7 +762,7 @@ TestResults pingPongTest(ITaskSystem* t, bool equal_work, bool do_async,
                 deps.push_back(prev_task_id);
             }
             prev_task_id = t->runAsyncWithDeps(
-                runnables[i], num_tasks, deps);
+                runnables[i], num_tasks, deps, options);
         } else {
             t->run(runnables[i], num_tasks);
         }
@@ -689,6 +827,18 @@ TestResults superLightAsyncTest(ITaskSystem* t) {
     return pingPongTest(t, true, true, num_elements, base_iters);
 }
 
+/*
+ * Task i of each launch only reads what task i of the previous launch
+ * wrote, so launches may overlap with element-wise dependencies.
+ */
+TestResults superLightElementWiseAsyncTest(ITaskSystem* t) {
+    int num_elements = 32 * 1024;
+    int base_iters = 32;
+    LaunchOptions options;
+    options.dependency = DependencyKind::ElementWise;
+    return pingPongTest(t, true, true, num_elements, base_iters, options);
+}
+
 TestResults pingPongEqualTest(ITaskSystem* t) {
     int num_elements = 512 * 1024;
     int base_iters = 32;
@@ -713,6 +863,32 @@ TestResults pingPongUnequalAsyncTest(ITaskSystem* t) {
     return pingPongTest(t, false, true, num_elements, base_iters);
 }
 
+/*
+ * The ping-pong tests again through IRangeRunnable::runRange(), to compare
+ * with their runTask() versions above: with one call per chunk of tasks,
+ * not per task, the difference is largest where tasks do the least work.
+ */
+TestResults superSuperLightRangeTest(ITaskSystem* t) {
+    int num_elements = 32 * 1024;
+    int base_iters = 0;
+    return pingPongTest<PingPongRangeTask>(t, true, false, num_elements,
+                                           base_iters);
+}
+
+TestResults pingPongEqualRangeTest(ITaskSystem* t) {
+    int num_elements = 512 * 1024;
+    int base_iters = 32;
+    return pingPongTest<PingPongRangeTask>(t, true, false, num_elements,
+                                           base_iters);
+}
+
+TestResults pingPongEqualRangeAsyncTest(ITaskSystem* t) {
+    int num_elements = 512 * 1024;
+    int base_iters = 32;
+    return pingPongTest<PingPongRangeTask>(t, true, true, num_elements,
+                                           base_iters);
+}
+
 /*
  * Computation: The following tests compute Fibonacci numbers using
  * recursion. Since the tasks are compute intensive, the tests show
@@ -772,6 +948,57 @@ TestResults recursiveFibonacciTest(ITaskSystem* t) {
     return recursiveFibonacciTestBase(t, false);
 }
 
+/*
+ * Computation: Same Fibonacci numbers, with the recursion itself made of
+ * bulk task launches issued from inside runTask(). With do_async the
+ * tasks launch with runAsyncWithDeps() and wait with sync(), which only
+ * has to cover what the calling task launched.
+ */
+TestResults nestedFibonacciTestBase(ITaskSystem* t, bool do_async) {
+
+    int num_tasks = 16;
+    int fib_index = 28;
+    int cutoff = 16;
+
+    int* task_idx = new int[num_tasks];
+    int* task_output = new int[num_tasks];
+    for (int i = 0; i < num_tasks; i++) {
+        task_idx[i] = fib_index;
+        task_output[i] = 0;
+    }
+    NestedFibonacciTask fib_task(t, task_idx, task_output, cutoff, do_async);
+
+    double start_time = CycleTimer::currentSeconds();
+    t->run(&fib_task, num_tasks);
+    double end_time = CycleTimer::currentSeconds();
+
+    // Validate correctness
+    int expected = RecursiveFibonacciTask(fib_index, NULL).slowFn(fib_index);
+    TestResults result;
+    result.passed = true;
+    for (int i = 0; i < num_tasks; i++) {
+        if (task_output[i] != expected) {
+            printf("%d: %d expected=%d\n", i, task_output[i], expected);
+            result.passed = false;
+            break;
+        }
+    }
+    result.time = end_time - start_time;
+
+    delete [] task_idx;
+    delete [] task_output;
+
+    return result;
+}
+
+TestResults nestedFibonacciTest(ITaskSystem* t) {
+    return nestedFibonacciTestBase(t, false);
+}
+
+TestResults nestedFibonacciAsyncTest(ITaskSystem* t) {
+    return nestedFibonacciTestBase(t, true);
+}
+
 TestResults recursiveFibonacciAsyncTest(ITaskSystem* t) {
     return recursiveFibonacciTestBase(t, true);
 }
@@ -780,10 +1007,12 @@ TestResults recursiveFibonacciAsyncTest(ITaskSystem* t) {
  * Computation: The following tests perform exps, logs, and multiplications
  * in a tight for loop. Tasks are sufficiently compute-intensive and lightweight:
  * the threadpool implementation should perform better than the one that spawns
- * new threads with every bulk task launch.
+ * new threads with every bulk task launch. With `use_span`, the dependency on
+ * the previous launch is passed as a span instead of a vector.
  */
 TestResults mathOperationsInTightForLoopTestBase(ITaskSystem* t, int num_tasks,
-                                                 bool run_with_dependencies, bool do_async) {
+                                                 bool run_with_dependencies, bool do_async,
+                                                 bool use_span = false) {
 
     int num_bulk_task_launches = 2000;
 
@@ -803,8 +1032,13 @@ TestResults mathOperationsInTightForLoopTestBase(ITaskSystem* t, int num_tasks,
     double start_time = CycleTimer::currentSeconds();
     if (do_async) {
         if (run_with_dependencies) {
-            TaskID prev_task_id;
+            TaskID prev_task_id = 0;
             for (int i = 0; i < num_bulk_task_launches; i++) {
+                if (use_span) {
+                    std::span<const TaskID> deps(&prev_task_id, i > 0 ? 1 : 0);
+                    prev_task_id = t->runAsyncWithDeps(&medium_tasks[i], num_tasks, deps);
+                    continue;
+                }
                 std::vector<TaskID> deps;
                 if (i > 0) {
                     deps.push_back(prev_task_id);
@@ -861,6 +1095,10 @@ TestResults mathOperationsInTightForLoopAsyncTest(ITaskSystem* t) {
     return mathOperationsInTightForLoopTestBase(t, 16, true, true);
 }
 
+TestResults mathOperationsInTightForLoopSpanAsyncTest(ITaskSystem* t) {
+    return mathOperationsInTightForLoopTestBase(t, 16, true, true, true);
+}
+
 TestResults mathOperationsInTightForLoopFewerTasksTest(ITaskSystem* t) {
     return mathOperationsInTightForLoopTestBase(t, 9, false, false);
 }
@@ -1403,3 +1641,1181 @@ TestResults strictGraphDepsMedium(ITaskSystem* t) {
 TestResults strictGraphDepsLarge(ITaskSystem* t) {
     return strictGraphDepsTestBase(t,1000,20000,0);
 }
+
+/*
+ * Computation: The same 400-launch ping-pong chain of super light tasks as
+ * superSuperLightAsyncTest, run over and over. The replay variant records
+ * the chain into a TaskGraph once and launches it with runGraph(), the
+ * resubmit variant calls runAsyncWithDeps() for every launch of every round.
+ * Comparing the two shows the per-launch cost of submission.
+ */
+TestResults graphReplayTestBase(ITaskSystem* t, bool replay) {
+    int num_elements = 4 * 1024;
+    int num_tasks = 64;
+    int num_bulk_task_launches = 400;
+    int num_rounds = 20;
+    int iters = 2;  // each launch adds 1 to every element
+
+    int* input = new int[num_elements];
+    int* output = new int[num_elements];
+    for (int i=0; i<num_elements; i++) {
+        input[i] = i;
+        output[i] = 0;
+    }
+
+    std::vector<PingPongTask*> runnables(num_bulk_task_launches);
+    for (int i=0; i<num_bulk_task_launches; i++) {
+        if (i % 2 == 0)
+            runnables[i] = new PingPongTask(
+                num_elements, input, output, true, iters);
+        else
+            runnables[i] = new PingPongTask(
+                num_elements, output, input, true, iters);
+    }
+
+    TaskGraphBuilder builder;
+    TaskID prev_node = 0;
+    for (int i=0; i<num_bulk_task_launches; i++) {
+        std::vector<TaskID> deps;
+        if (i > 0) {
+            deps.push_back(prev_node);
+        }
+        prev_node = builder.add(runnables[i], num_tasks, deps);
+    }
+    TaskGraph graph = builder.build();
+
+    // Run the test
+    double start_time = CycleTimer::currentSeconds();
+    for (int round=0; round<num_rounds; round++) {
+        if (replay) {
+            t->runGraph(graph);
+            continue;
+        }
+        TaskID prev_task_id = 0;
+        for (int i=0; i<num_bulk_task_launches; i++) {
+            std::vector<TaskID> deps;
+            if (i > 0) {
+                deps.push_back(prev_task_id);
+            }
+            prev_task_id = t->runAsyncWithDeps(
+                runnables[i], num_tasks, deps);
+        }
+        t->sync();
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    // Correctness validation, an even number of launches per round leaves
+    // the result in `input`
+    TestResults results;
+    results.passed = true;
+    for (int i=0; i<num_elements; i++) {
+        int expected = i + num_rounds * num_bulk_task_launches;
+        if (input[i] != expected) {
+            results.passed = false;
+            printf("%d: %d expected=%d\n", i, input[i], expected);
+            break;
+        }
+    }
+    results.time = end_time - start_time;
+
+    delete [] input;
+    delete [] output;
+    for (int i=0; i<num_bulk_task_launches; i++)
+        delete runnables[i];
+
+    return results;
+}
+
+TestResults graphReplayTest(ITaskSystem* t) {
+    return graphReplayTestBase(t, true);
+}
+
+TestResults graphResubmitTest(ITaskSystem* t) {
+    return graphReplayTestBase(t, false);
+}
+
+/*
+ * Computation: A short ping-pong chain is submitted, then a pile of heavy
+ * Fibonacci launches that have nothing to do with it. The test reads the
+ * chain's output after wait() on its last launch, and times how long that
+ * takes. A task system that can only sync() waits for the pile as well.
+ */
+TestResults waitSingleLaunchTest(ITaskSystem* t) {
+    int num_elements = 4 * 1024;
+    int num_tasks = 64;
+    int chain_length = 4;
+    int num_heavy_launches = 16;
+
+    int* input = new int[num_elements];
+    int* output = new int[num_elements];
+    for (int i=0; i<num_elements; i++) {
+        input[i] = i;
+        output[i] = 0;
+    }
+    int* fib_output = new int[num_tasks];
+
+    std::vector<PingPongTask*> chain(chain_length);
+    for (int i=0; i<chain_length; i++) {
+        if (i % 2 == 0)
+            chain[i] = new PingPongTask(num_elements, input, output, true, 2);
+        else
+            chain[i] = new PingPongTask(num_elements, output, input, true, 2);
+    }
+    RecursiveFibonacciTask heavy(25, fib_output);
+
+    double start_time = CycleTimer::currentSeconds();
+    TaskID last_task_id = 0;
+    for (int i=0; i<chain_length; i++) {
+        std::vector<TaskID> deps;
+        if (i > 0) {
+            deps.push_back(last_task_id);
+        }
+        last_task_id = t->runAsyncWithDeps(chain[i], num_tasks, deps);
+    }
+    std::vector<TaskID> no_deps;
+    for (int i=0; i<num_heavy_launches; i++) {
+        t->runAsyncWithDeps(&heavy, num_tasks, no_deps);
+    }
+    t->wait(last_task_id);
+    double end_time = CycleTimer::currentSeconds();
+
+    // Correctness validation, the chain has to be complete by now
+    TestResults results;
+    results.passed = t->isDone(last_task_id);
+    if (!results.passed) {
+        printf("isDone() is false after wait()\n");
+    }
+    int* buffer = (chain_length % 2 == 1) ? output : input;
+    for (int i=0; i<num_elements && results.passed; i++) {
+        int expected = i + chain_length;
+        if (buffer[i] != expected) {
+            results.passed = false;
+            printf("%d: %d expected=%d\n", i, buffer[i], expected);
+        }
+    }
+    results.time = end_time - start_time;
+
+    t->sync();
+
+    delete [] input;
+    delete [] output;
+    delete [] fib_output;
+    for (int i=0; i<chain_length; i++)
+        delete chain[i];
+
+    return results;
+}
+
+/*
+ * Fire-and-forget coroutine: it runs up to its first co_await right away
+ * and frees itself when it returns.
+ */
+struct DetachedCoroutine {
+    struct promise_type {
+        DetachedCoroutine get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+DetachedCoroutine pipelineCoroutine(ITaskSystem* t,
+                                    const std::vector<PingPongTask*>& steps,
+                                    int num_tasks,
+                                    std::atomic<int>* num_running) {
+    std::vector<TaskID> no_deps;
+    for (PingPongTask* step : steps) {
+        TaskID task_id = t->runAsyncWithDeps(step, num_tasks, no_deps);
+        co_await LaunchAwaiter(t, task_id);
+    }
+    num_running->fetch_sub(1);
+}
+
+/*
+ * Computation: Independent pipelines of ping-pong steps, where the code
+ * driving a pipeline looks at each step before launching the next. With
+ * coroutines each pipeline co_awaits its own steps and moves on as soon
+ * as they are done. Without, the driver launches one step of every
+ * pipeline and blocks in sync() before the next round.
+ */
+TestResults pipelineTestBase(ITaskSystem* t, bool use_coroutines) {
+    int num_pipelines = 16;
+    int num_steps = 64;
+    int num_elements = 1024;
+    int num_tasks = 16;
+
+    std::vector<int*> buffers;
+    std::vector<std::vector<PingPongTask*>> steps(num_pipelines);
+    for (int p=0; p<num_pipelines; p++) {
+        int* input = new int[num_elements];
+        int* output = new int[num_elements];
+        for (int i=0; i<num_elements; i++) {
+            input[i] = i;
+            output[i] = 0;
+        }
+        buffers.push_back(input);
+        buffers.push_back(output);
+        for (int s=0; s<num_steps; s++) {
+            if (s % 2 == 0)
+                steps[p].push_back(new PingPongTask(
+                    num_elements, input, output, true, 2));
+            else
+                steps[p].push_back(new PingPongTask(
+                    num_elements, output, input, true, 2));
+        }
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    if (use_coroutines) {
+        std::atomic<int> num_running(num_pipelines);
+        for (int p=0; p<num_pipelines; p++) {
+            pipelineCoroutine(t, steps[p], num_tasks, &num_running);
+        }
+        // a suspended pipeline always has a launch in flight
+        while (num_running.load() > 0) {
+            t->sync();
+        }
+    } else {
+        std::vector<TaskID> no_deps;
+        for (int s=0; s<num_steps; s++) {
+            for (int p=0; p<num_pipelines; p++) {
+                t->runAsyncWithDeps(steps[p][s], num_tasks, no_deps);
+            }
+            t->sync();
+        }
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    // Correctness validation, an even number of steps leaves the result
+    // in each pipeline's input
+    TestResults results;
+    results.passed = true;
+    for (int p=0; p<num_pipelines && results.passed; p++) {
+        int* buffer = buffers[2 * p];
+        for (int i=0; i<num_elements; i++) {
+            if (buffer[i] != i + num_steps) {
+                results.passed = false;
+                printf("%d/%d: %d expected=%d\n", p, i, buffer[i],
+                       i + num_steps);
+                break;
+            }
+        }
+    }
+    results.time = end_time - start_time;
+
+    for (int* buffer : buffers)
+        delete [] buffer;
+    for (auto& pipeline : steps)
+        for (PingPongTask* step : pipeline)
+            delete step;
+
+    return results;
+}
+
+TestResults coroutinePipelineTest(ITaskSystem* t) {
+    return pipelineTestBase(t, true);
+}
+
+TestResults syncPipelineTest(ITaskSystem* t) {
+    return pipelineTestBase(t, false);
+}
+
+/*
+ * Computation: the chain of launches of pingPongTest with equal work,
+ * written with parallel_for() (sync) or launch() (async) and a lambda
+ * instead of a PingPongTask subclass. Each launch has the same 64 tasks.
+ */
+TestResults lambdaPingPongTest(ITaskSystem* t, bool do_async,
+                               int num_elements, int base_iters) {
+    int num_tasks = 64;
+    int num_bulk_task_launches = 400;
+    int grain = (num_elements + num_tasks - 1) / num_tasks;
+
+    int* input = new int[num_elements];
+    int* output = new int[num_elements];
+    for (int i=0; i<num_elements; i++) {
+        input[i] = i;
+        output[i] = 0;
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    TaskID prev_task_id = 0;
+    for (int i=0; i<num_bulk_task_launches; i++) {
+        int* in = (i % 2 == 0) ? input : output;
+        int* out = (i % 2 == 0) ? output : input;
+        if (do_async) {
+            std::vector<TaskID> deps;
+            if (i > 0) {
+                deps.push_back(prev_task_id);
+            }
+            prev_task_id = t->launch(num_tasks,
+                [=](int task_id, int) {
+                    int start_el = grain * task_id;
+                    int end_el = std::min(start_el + grain, num_elements);
+                    for (int j=start_el; j<end_el; j++)
+                        out[j] = PingPongTask::ping_pong_work(base_iters, in[j]);
+                }, deps);
+        } else {
+            t->parallel_for(0, num_elements, grain, [=](int j) {
+                out[j] = PingPongTask::ping_pong_work(base_iters, in[j]);
+            });
+        }
+    }
+    if (do_async)
+        t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    // Correctness validation
+    TestResults results;
+    results.passed = true;
+    int* buffer = (num_bulk_task_launches % 2 == 1) ? output : input;
+    for (int i=0; i<num_elements; i++) {
+        int expected = i;
+        for (int j=0; j<num_bulk_task_launches; j++)
+            expected = PingPongTask::ping_pong_work(base_iters, expected);
+        if (buffer[i] != expected) {
+            results.passed = false;
+            printf("%d: %d expected=%d\n", i, buffer[i], expected);
+            break;
+        }
+    }
+    results.time = end_time - start_time;
+
+    delete [] input;
+    delete [] output;
+
+    return results;
+}
+
+TestResults superSuperLightParallelForTest(ITaskSystem* t) {
+    return lambdaPingPongTest(t, false, 32 * 1024, 0);
+}
+
+TestResults superSuperLightLaunchAsyncTest(ITaskSystem* t) {
+    return lambdaPingPongTest(t, true, 32 * 1024, 0);
+}
+
+/*
+ * Computation: A producer that submits many small independent LightTask
+ * launches as fast as it can and syncs once at the end, far more than the
+ * task system can run in the meantime. Every other launch goes through
+ * tryRunAsyncWithDeps() first and only falls back to runAsyncWithDeps()
+ * if the task system turns it away.
+ */
+TestResults overloadAsyncTest(ITaskSystem* t) {
+    int num_launches = 1000;
+    int num_tasks = 16;
+
+    int* output = new int[num_launches * num_tasks];
+    for (int i=0; i<num_launches * num_tasks; i++)
+        output[i] = -1;
+    std::vector<LightTask*> runnables;
+    for (int i=0; i<num_launches; i++)
+        runnables.push_back(new LightTask(output + i * num_tasks));
+
+    std::vector<TaskID> no_deps;
+    double start_time = CycleTimer::currentSeconds();
+    for (int i=0; i<num_launches; i++) {
+        if (i % 2 == 1 &&
+            t->tryRunAsyncWithDeps(runnables[i], num_tasks, no_deps))
+            continue;
+        t->runAsyncWithDeps(runnables[i], num_tasks, no_deps);
+    }
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    // Correctness validation
+    TestResults results;
+    results.passed = true;
+    for (int i=0; i<num_launches * num_tasks; i++) {
+        if (output[i] != i % num_tasks) {
+            results.passed = false;
+            printf("%d: %d expected=%d\n", i, output[i], i % num_tasks);
+            break;
+        }
+    }
+    results.time = end_time - start_time;
+
+    for (LightTask* runnable : runnables)
+        delete runnable;
+    delete [] output;
+
+    return results;
+}
+
+/*
+ * Computation: A batch of long RecursiveFibonacciTask launches at Low
+ * priority, and behind it a chain of light launches at High priority that
+ * each depend on the one before. The time reported is until the chain is
+ * done, which should not have to wait for the batch.
+ */
+TestResults priorityMixAsyncTest(ITaskSystem* t) {
+    int num_batch_launches = 4;
+    int num_batch_tasks = 16;
+    int fib_idx = 30;
+    int num_chain_launches = 256;
+    int num_chain_tasks = 16;
+
+    int* batch_output = new int[num_batch_launches * num_batch_tasks];
+    int* chain_output = new int[num_chain_tasks];
+    for (int i=0; i<num_batch_launches * num_batch_tasks; i++)
+        batch_output[i] = 0;
+    for (int i=0; i<num_chain_tasks; i++)
+        chain_output[i] = -1;
+
+    std::vector<RecursiveFibonacciTask*> batch;
+    for (int i=0; i<num_batch_launches; i++)
+        batch.push_back(new RecursiveFibonacciTask(
+            fib_idx, batch_output + i * num_batch_tasks));
+    LightTask light_task(chain_output);
+
+    LaunchOptions low;
+    low.priority = LaunchPriority::Low;
+    LaunchOptions high;
+    high.priority = LaunchPriority::High;
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    for (RecursiveFibonacciTask* task : batch)
+        t->runAsyncWithDeps(task, num_batch_tasks, no_deps, low);
+    std::vector<TaskID> deps;
+    for (int i=0; i<num_chain_launches; i++) {
+        TaskID task_id = t->runAsyncWithDeps(
+            &light_task, num_chain_tasks, deps, high);
+        deps.assign(1, task_id);
+    }
+    t->wait(deps[0]);
+    double end_time = CycleTimer::currentSeconds();
+    t->sync();
+
+    // Correctness validation
+    TestResults results;
+    results.passed = true;
+    int a = 1, b = 1;
+    for (int i=1; i<fib_idx; i++) {
+        int next = a + b;
+        a = b;
+        b = next;
+    }
+    for (int i=0; i<num_batch_launches * num_batch_tasks; i++) {
+        if (batch_output[i] != b) {
+            results.passed = false;
+            printf("batch %d: %d expected=%d\n", i, batch_output[i], b);
+            break;
+        }
+    }
+    for (int i=0; i<num_chain_tasks; i++) {
+        if (chain_output[i] != i) {
+            results.passed = false;
+            printf("chain %d: %d expected=%d\n", i, chain_output[i], i);
+            break;
+        }
+    }
+    results.time = end_time - start_time;
+
+    for (RecursiveFibonacciTask* task : batch)
+        delete task;
+    delete [] batch_output;
+    delete [] chain_output;
+
+    return results;
+}
+
+/*
+ * Computation: The random graph of strictGraphDepsTestBase, with launch
+ * `cancel_idx` cancelled once half of the graph is submitted. If it was
+ * not done yet, exactly the launches that depend on it, directly or not,
+ * must come back cancelled from sync(), and every other launch must still
+ * see its dependencies done.
+ */
+TestResults strictGraphDepsCancelTestBase(ITaskSystem* t, int n, int m,
+                                          unsigned int seed, int cancel_idx) {
+    srand(seed);
+
+    bool *done = new bool[n]();
+    std::vector<int> idx_deps[n];
+    std::vector<bool*> flag_deps[n];
+    std::vector<TaskID> task_deps[n];
+    TaskID *task_ids = new TaskID[n];
+    std::set<std::pair<int,int> > eset;
+
+    for (int i = 0; i < m; i++) {
+        int s = rand() % n;
+        int t = rand() % n;
+        if (s > t) {
+            std::swap(s,t);
+        }
+        if (s == t || eset.count({s,t})) {
+            continue;
+        }
+        idx_deps[t].push_back(s);
+        flag_deps[t].push_back(done + s);
+        eset.insert({s,t});
+    }
+
+    std::vector<IRunnable*> tasks;
+    for (int i = 0; i < n; i++) {
+        tasks.push_back(new StrictDependencyTask(flag_deps[i], done + i));
+    }
+
+    // launches depend only on earlier ones
+    std::vector<bool> doomed(n, false);
+    doomed[cancel_idx] = true;
+    for (int i = cancel_idx + 1; i < n; i++) {
+        for (int idx : idx_deps[i]) {
+            if (doomed[idx]) {
+                doomed[i] = true;
+            }
+        }
+    }
+
+    bool cancelled = false;
+    double start_time = CycleTimer::currentSeconds();
+    for (int i = 0; i < n; i++) {
+        if (i == n / 2) {
+            cancelled = t->cancel(task_ids[cancel_idx]);
+        }
+        for (int idx : idx_deps[i]) {
+            task_deps[i].push_back(task_ids[idx]);
+        }
+        task_ids[i] = t->runAsyncWithDeps(tasks[i], (rand() % 15) + 1, task_deps[i]);
+    }
+    LaunchStatus status = t->wait(task_ids[cancel_idx]);
+    std::vector<TaskID> reported;
+    t->sync(reported);
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = status == (cancelled ? LaunchStatus::Cancelled
+                                         : LaunchStatus::Done);
+    std::set<TaskID> reported_set(reported.begin(), reported.end());
+    for (int i = 0; i < n; i++) {
+        bool expect_cancelled = cancelled && doomed[i];
+        if (reported_set.count(task_ids[i]) != (expect_cancelled ? 1u : 0u)) {
+            printf("launch %d: cancelled=%d expected=%d\n", i,
+                   (int)reported_set.count(task_ids[i]), (int)expect_cancelled);
+            result.passed = false;
+            break;
+        }
+        if (!expect_cancelled && !done[i]) {
+            printf("launch %d ran before its dependencies\n", i);
+            result.passed = false;
+            break;
+        }
+    }
+    if (reported.size() != reported_set.size()) {
+        result.passed = false;
+    }
+    result.time = end_time - start_time;
+
+    for (IRunnable* task : tasks) {
+        delete task;
+    }
+    delete [] done;
+    delete [] task_ids;
+    return result;
+}
+
+TestResults strictGraphDepsCancelTest(ITaskSystem* t) {
+    return strictGraphDepsCancelTestBase(t, 1000, 20000, 0, 100);
+}
+
+/*
+ * Implementation of a task that throws from task `throw_at`, and counts
+ * the tasks that ran.
+ */
+class ThrowingTask : public IRunnable {
+    public:
+        int throw_at_;
+        std::atomic<int> num_run_;
+        ThrowingTask(int throw_at) : throw_at_(throw_at), num_run_(0) {}
+        ~ThrowingTask() {}
+
+        void runTask(int task_id, int) {
+            num_run_++;
+            if (task_id == throw_at_) {
+                throw std::runtime_error("task failed");
+            }
+        }
+};
+
+/*
+ * Computation: A run() whose launch throws, a chain of three launches
+ * whose middle one throws, and a single throwing launch waited on. Each
+ * exception must come out of exactly one call: run(), wait() or sync(),
+ * or runAsyncWithDeps() for task systems that launch synchronously. The
+ * launch after the one that threw must never run, and the task system
+ * must still run launches normally afterwards.
+ */
+TestResults throwingTaskTest(ITaskSystem* t) {
+    int num_tasks = 256;
+    ThrowingTask bad_run(num_tasks / 2);
+    ThrowingTask first(-1);
+    ThrowingTask bad_async(num_tasks / 2);
+    ThrowingTask dependent(-1);
+    ThrowingTask bad_wait(0);
+    ThrowingTask last(-1);
+    std::vector<TaskID> no_deps;
+
+    double start_time = CycleTimer::currentSeconds();
+    int run_caught = 0;
+    try {
+        t->run(&bad_run, num_tasks);
+    } catch (const std::runtime_error&) {
+        run_caught++;
+    }
+
+    // the dependent comes back cancelled without throwing itself
+    int sync_caught = 0;
+    try {
+        TaskID a = t->runAsyncWithDeps(&first, num_tasks, no_deps);
+        TaskID b = t->runAsyncWithDeps(&bad_async, num_tasks,
+                                       std::vector<TaskID>{a});
+        TaskID c = t->runAsyncWithDeps(&dependent, num_tasks,
+                                       std::vector<TaskID>{b});
+        t->wait(c);
+        t->sync();
+    } catch (const std::runtime_error&) {
+        sync_caught++;
+    }
+
+    int wait_caught = 0;
+    try {
+        TaskID d = t->runAsyncWithDeps(&bad_wait, num_tasks, no_deps);
+        t->wait(d);
+    } catch (const std::runtime_error&) {
+        wait_caught++;
+    }
+    // wait() reported it already
+    try {
+        t->sync();
+    } catch (const std::runtime_error&) {
+        wait_caught++;
+    }
+
+    t->run(&last, num_tasks);
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = run_caught == 1 && sync_caught == 1 && wait_caught == 1 &&
+                    first.num_run_ == num_tasks && dependent.num_run_ == 0 &&
+                    last.num_run_ == num_tasks;
+    if (!result.passed) {
+        printf("caught %d/%d/%d, ran %d/%d/%d\n", run_caught, sync_caught,
+               wait_caught, first.num_run_.load(), dependent.num_run_.load(),
+               last.num_run_.load());
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Implementation of a task that adds one to its part of `array`.
+ */
+class IncrementTask : public IRunnable {
+    public:
+        int* array_;
+        int size_;
+        IncrementTask(int* array, int size) : array_(array), size_(size) {}
+        ~IncrementTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int size_per_task = (size_ + num_total_tasks - 1) / num_total_tasks;
+            int start = size_per_task * task_id;
+            int end = std::min(start + size_per_task, size_);
+            for (int i = start; i < end; i++) {
+                array_[i]++;
+            }
+        }
+};
+
+/*
+ * Computation: Several threads each submit a chain of launches adding one
+ * to their own array, through a stream of their own from createStream(),
+ * and sync() that stream alone. Every element must count the whole chain.
+ * Task systems without streams run the chains one thread at a time.
+ */
+TestResults streamsTest(ITaskSystem* t) {
+    int num_streams = 4;
+    int num_launches = 64;
+    int num_tasks = 16;
+    int size = 1024;
+
+    std::vector<std::vector<int>> arrays(num_streams, std::vector<int>(size, 0));
+    std::vector<int> caught(num_streams, 0);
+    auto submit = [&](ITaskSystem* s, int k) {
+        IncrementTask task(arrays[k].data(), size);
+        std::vector<TaskID> deps;
+        for (int i = 0; i < num_launches; i++) {
+            TaskID id = s->runAsyncWithDeps(&task, num_tasks, deps);
+            deps.assign(1, id);
+        }
+        // stream ids of earlier launches must still be waitable
+        s->wait(deps[0]);
+        s->sync();
+    };
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<std::unique_ptr<ITaskSystem>> streams;
+    for (int k = 0; k < num_streams; k++) {
+        streams.push_back(t->createStream());
+    }
+    if (streams[0] == nullptr) {
+        for (int k = 0; k < num_streams; k++) {
+            submit(t, k);
+        }
+    } else {
+        std::vector<std::thread> threads;
+        for (int k = 0; k < num_streams; k++) {
+            threads.emplace_back([&, k] {
+                try {
+                    submit(streams[k].get(), k);
+                } catch (...) {
+                    caught[k]++;
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+    streams.clear();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = true;
+    for (int k = 0; k < num_streams && result.passed; k++) {
+        for (int i = 0; i < size; i++) {
+            if (caught[k] != 0 || arrays[k][i] != num_launches) {
+                printf("stream %d: element %d is %d, expected %d\n", k, i,
+                       arrays[k][i], num_launches);
+                result.passed = false;
+                break;
+            }
+        }
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Computation: Eight threads submit chains of launches to the same task
+ * system at once, each adding one to its own array, and every chain
+ * starts behind one launch the main thread submitted. The main thread
+ * then syncs for all of them. Every element must count its whole chain.
+ * Task systems that take one submitting thread at a time get the chains
+ * one after the other.
+ */
+TestResults concurrentSubmitTest(ITaskSystem* t) {
+    int num_producers = 8;
+    int num_launches = 256;
+    int num_tasks = 4;
+    int size = 256;
+
+    std::vector<std::vector<int>> arrays(num_producers,
+                                         std::vector<int>(size, 0));
+    std::vector<int> first(1, 0);
+    IncrementTask first_task(first.data(), 1);
+    auto submit = [&](int k, TaskID root) {
+        IncrementTask task(arrays[k].data(), size);
+        std::vector<TaskID> deps(1, root);
+        for (int i = 0; i < num_launches; i++) {
+            deps.assign(1, t->runAsyncWithDeps(&task, num_tasks, deps));
+        }
+        // the chain's last launch still reads the task
+        t->wait(deps[0]);
+    };
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    TaskID root = t->runAsyncWithDeps(&first_task, 1, no_deps);
+    if (t->supportsConcurrentSubmit()) {
+        std::vector<std::thread> threads;
+        for (int k = 0; k < num_producers; k++) {
+            threads.emplace_back(submit, k, root);
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    } else {
+        for (int k = 0; k < num_producers; k++) {
+            submit(k, root);
+        }
+    }
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = first[0] == 1;
+    for (int k = 0; k < num_producers && result.passed; k++) {
+        for (int i = 0; i < size; i++) {
+            if (arrays[k][i] != num_launches) {
+                printf("producer %d: element %d is %d, expected %d\n", k, i,
+                       arrays[k][i], num_launches);
+                result.passed = false;
+                break;
+            }
+        }
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Each task keeps its worker busy for `busy_us` microseconds, then counts
+ * itself in counts[task_id].
+ */
+class BusyTask : public IRunnable {
+    public:
+        int* counts_;
+        int busy_us_;
+        BusyTask(int* counts, int busy_us)
+            : counts_(counts), busy_us_(busy_us) {}
+        ~BusyTask() {}
+
+        void runTask(int task_id, int) {
+            double end = CycleTimer::currentSeconds() + busy_us_ * 1e-6;
+            while (CycleTimer::currentSeconds() < end) {
+            }
+            counts_[task_id]++;
+        }
+};
+
+/*
+ * Computation: Bursts of launches separated by idle pauses, the kind of
+ * load an elastic pool grows for and shrinks after. Each burst is a chain
+ * of launches adding one to an array, beside a launch of tasks that keep
+ * their workers busy for a while. Run with TASKSYS_ELASTIC set the pauses
+ * outlast a short retire time, so workers come and go between bursts.
+ */
+TestResults burstsTest(ITaskSystem* t) {
+    int num_bursts = 4;
+    int num_launches = 64;
+    int num_tasks = 16;
+    int size = 1024;
+    int pause_ms = 30;
+
+    std::vector<int> array(size, 0);
+    IncrementTask task(array.data(), size);
+    std::vector<int> busy(num_tasks, 0);
+    BusyTask busy_task(busy.data(), 2000);
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    for (int b = 0; b < num_bursts; b++) {
+        t->runAsyncWithDeps(&busy_task, num_tasks, no_deps);
+        std::vector<TaskID> deps;
+        for (int i = 0; i < num_launches; i++) {
+            deps.assign(1, t->runAsyncWithDeps(&task, num_tasks, deps));
+        }
+        t->sync();
+        std::this_thread::sleep_for(std::chrono::milliseconds(pause_ms));
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = true;
+    for (int i = 0; i < size; i++) {
+        if (array[i] != num_bursts * num_launches) {
+            printf("element %d is %d, expected %d\n", i, array[i],
+                   num_bursts * num_launches);
+            result.passed = false;
+            break;
+        }
+    }
+    for (int i = 0; i < num_tasks && result.passed; i++) {
+        if (busy[i] != num_bursts) {
+            printf("busy task %d ran %d times, expected %d\n", i, busy[i],
+                   num_bursts);
+            result.passed = false;
+        }
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Each task copies its share of `values` into a buffer from the worker's
+ * scratch arena and adds it up into sums[worker_index], without atomics.
+ * It notes when a task finds its worker index in use by another task, an
+ * index out of range, or scratch memory left over from an earlier task of
+ * the worker.
+ */
+class WorkerSumTask : public IContextRunnable {
+    public:
+        const std::vector<int>& values_;
+        std::vector<int64_t>& sums_;
+        std::vector<std::atomic<bool>>& in_use_;
+        std::vector<void*>& first_scratch_;
+        std::atomic<int> errors_;
+
+        WorkerSumTask(const std::vector<int>& values,
+                      std::vector<int64_t>& sums,
+                      std::vector<std::atomic<bool>>& in_use,
+                      std::vector<void*>& first_scratch)
+            : values_(values), sums_(sums), in_use_(in_use),
+              first_scratch_(first_scratch), errors_(0) {}
+        ~WorkerSumTask() {}
+
+        void runTask(int task_id, int num_total_tasks,
+                     WorkerContext& context) {
+            int index = context.worker_index;
+            if (index < 0 || index >= static_cast<int>(sums_.size())) {
+                errors_++;
+                return;
+            }
+            if (in_use_[index].exchange(true)) {
+                errors_++;
+            }
+
+            int size = values_.size();
+            int size_per_task = (size + num_total_tasks - 1) / num_total_tasks;
+            int start = std::min(size_per_task * task_id, size);
+            int end = std::min(start + size_per_task, size);
+            int* buffer = context.scratch.allocate<int>(end - start);
+            // the arena is rewound after every task, so each task of a
+            // worker gets the same memory
+            if (first_scratch_[index] == nullptr) {
+                first_scratch_[index] = buffer;
+            } else if (first_scratch_[index] != buffer) {
+                errors_++;
+            }
+            std::copy(values_.begin() + start, values_.begin() + end, buffer);
+            for (int i = 0; i < end - start; i++) {
+                sums_[index] += buffer[i];
+            }
+
+            in_use_[index].store(false);
+        }
+};
+
+/*
+ * Computation: Sums an array through per-worker accumulators, with tasks
+ * indexed by the worker context the task system gives them, once with
+ * run() and once with a chain of launches from runAsyncWithDeps(). Task
+ * systems without worker contexts have nothing to check.
+ */
+TestResults workerContextTest(ITaskSystem* t) {
+    int num_contexts = t->numWorkerContexts();
+    TestResults result;
+    result.passed = true;
+    result.time = 0;
+    if (num_contexts == 0) {
+        return result;
+    }
+
+    int size = 1 << 20;
+    int num_tasks = 256;
+    int num_launches = 16;
+    std::vector<int> values(size);
+    int64_t expected = 0;
+    for (int i = 0; i < size; i++) {
+        values[i] = i % 1000;
+        expected += values[i];
+    }
+
+    std::vector<int64_t> sums(num_contexts, 0);
+    std::vector<std::atomic<bool>> in_use(num_contexts);
+    std::vector<void*> first_scratch(num_contexts, nullptr);
+    WorkerSumTask task(values, sums, in_use, first_scratch);
+
+    double start_time = CycleTimer::currentSeconds();
+    t->run(&task, num_tasks);
+    std::vector<TaskID> deps;
+    for (int i = 0; i < num_launches; i++) {
+        deps.assign(1, t->runAsyncWithDeps(&task, num_tasks, deps));
+    }
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    int64_t total = 0;
+    for (int64_t sum : sums) {
+        total += sum;
+    }
+    if (task.errors_ != 0) {
+        printf("%d tasks saw a bad worker context\n", task.errors_.load());
+        result.passed = false;
+    }
+    if (total != expected * (num_launches + 1)) {
+        printf("sum is %lld, expected %lld\n", (long long)total,
+               (long long)(expected * (num_launches + 1)));
+        result.passed = false;
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Counts its live copies in `live`, to tell whether a launch() let go of
+ * its capture.
+ */
+class LiveCounter {
+    public:
+        std::atomic<int>* live_;
+        LiveCounter(std::atomic<int>* live) : live_(live) { (*live_)++; }
+        LiveCounter(const LiveCounter& other) : live_(other.live_) {
+            (*live_)++;
+        }
+        ~LiveCounter() { (*live_)--; }
+};
+
+/*
+ * Computation: launch() lambdas that get cancelled. A batch of them waits
+ * on a slow launch that is cancelled before it is done, so they never run
+ * a task, and one long one is cancelled once its first task ran. Once sync()
+ * returns, every capture must be gone either way, and the task system must
+ * still run launches normally afterwards.
+ */
+TestResults cancelLaunchTest(ITaskSystem* t) {
+    int num_launches = 16;
+    int num_tasks = 64;
+    std::atomic<int> live(0);
+    std::atomic<int> num_run(0);
+    std::atomic<int> num_slow(0);
+    std::vector<TaskID> no_deps;
+
+    double start_time = CycleTimer::currentSeconds();
+    {
+        LiveCounter counter(&live);
+        TaskID gate = t->launch(1, [counter](int, int) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }, no_deps);
+        std::vector<TaskID> deps(1, gate);
+        for (int i = 0; i < num_launches; i++) {
+            t->launch(num_tasks, [counter, &num_run](int, int) {
+                num_run++;
+            }, deps);
+        }
+        t->cancel(gate);
+
+        TaskID slow = t->launch(num_tasks * num_tasks,
+                                [counter, &num_slow](int, int) {
+            num_slow++;
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }, no_deps);
+        while (num_slow.load() == 0) {
+            std::this_thread::yield();
+        }
+        t->cancel(slow);
+    }
+    std::vector<TaskID> cancelled;
+    t->sync(cancelled);
+    int left = live.load();
+
+    std::atomic<int> num_after(0);
+    t->launch(num_tasks, [&num_after](int, int) { num_after++; }, no_deps);
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = left == 0 && num_after == num_tasks;
+    if (!result.passed) {
+        printf("%d captures left after %d cancelled launches, %d tasks ran "
+               "afterwards\n", left, (int)cancelled.size(), num_after.load());
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Computation: A launch() lambda that throws from one of its tasks, and a
+ * launch() that depends on it. The exception must come out of sync(), or
+ * launch() for task systems that launch synchronously, the dependent must
+ * never run, and both captures must be gone afterwards.
+ */
+TestResults throwingLaunchTest(ITaskSystem* t) {
+    int num_tasks = 256;
+    std::atomic<int> live(0);
+    std::atomic<int> num_dependent(0);
+    std::vector<TaskID> no_deps;
+
+    double start_time = CycleTimer::currentSeconds();
+    int caught = 0;
+    {
+        LiveCounter counter(&live);
+        try {
+            TaskID bad = t->launch(num_tasks, [counter, num_tasks](int task_id,
+                                                                   int) {
+                if (task_id == num_tasks / 2) {
+                    throw std::runtime_error("task failed");
+                }
+            }, no_deps);
+            t->launch(num_tasks, [counter, &num_dependent](int, int) {
+                num_dependent++;
+            }, std::vector<TaskID>{bad});
+            t->sync();
+        } catch (const std::runtime_error&) {
+            caught++;
+        }
+    }
+    int left = live.load();
+
+    std::atomic<int> num_after(0);
+    t->launch(num_tasks, [&num_after](int, int) { num_after++; }, no_deps);
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = caught == 1 && left == 0 && num_dependent == 0 &&
+                    num_after == num_tasks;
+    if (!result.passed) {
+        printf("caught %d, %d captures left, ran %d/%d\n", caught, left,
+               num_dependent.load(), num_after.load());
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Computation: A TaskGraph with a launch that throws, two launches that
+ * depend on it and one behind both, next to a launch that depends on
+ * nothing. It is run three times, so later runs replay the graph. Each
+ * run must rethrow once, the dependents must never run, and the others
+ * must run in full every time.
+ */
+TestResults graphThrowingTest(ITaskSystem* t) {
+    int num_tasks = 64;
+    int num_rounds = 3;
+    ThrowingTask other(-1);
+    ThrowingTask first(-1);
+    ThrowingTask bad(num_tasks / 2);
+    ThrowingTask left(-1);
+    ThrowingTask right(-1);
+    ThrowingTask last(-1);
+
+    TaskGraphBuilder builder;
+    builder.add(&other, num_tasks, {});
+    TaskID first_node = builder.add(&first, num_tasks, {});
+    TaskID bad_node = builder.add(&bad, num_tasks, {first_node});
+    TaskID left_node = builder.add(&left, num_tasks, {bad_node});
+    TaskID right_node = builder.add(&right, num_tasks, {bad_node});
+    builder.add(&last, num_tasks, {left_node, right_node});
+    TaskGraph graph = builder.build();
+
+    double start_time = CycleTimer::currentSeconds();
+    int caught = 0;
+    for (int round = 0; round < num_rounds; round++) {
+        try {
+            t->runGraph(graph);
+        } catch (const std::runtime_error&) {
+            caught++;
+        }
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = caught == num_rounds &&
+                    other.num_run_ == num_rounds * num_tasks &&
+                    first.num_run_ == num_rounds * num_tasks &&
+                    left.num_run_ == 0 && right.num_run_ == 0 &&
+                    last.num_run_ == 0;
+    if (!result.passed) {
+        printf("caught %d, ran %d/%d/%d/%d/%d\n", caught,
+               other.num_run_.load(), first.num_run_.load(),
+               left.num_run_.load(), right.num_run_.load(),
+               last.num_run_.load());
+    }
+    result.time = end_time - start_time;
+    return result;
+}